@@ -1,4 +1,12 @@
 #include "Commands.h"
+#include "signals.h"
+#include "zygote.h"
+#include "transfer.h"
+#include <poll.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <climits>
+#include <cmath>
 
 using namespace std;
 
@@ -30,120 +38,813 @@ string _trim(const std::string &s) {
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char *cmd_line, char **args) {
+static bool _isWhitespace(char c) {
+    return c != '\0' && strchr(WHITESPACE.c_str(), c) != nullptr;
+}
+
+//returns the last non whitespace character of cmd_line, or nullptr for a blank line
+static const char *_lastNonWhitespace(const char *cmd_line) {
+    const char *last = nullptr;
+    for (const char *c = cmd_line; *c; c++) {
+        if (!_isWhitespace(*c))
+            last = c;
+    }
+    return last;
+}
+
+/**
+* Splits the command line into args in place: the line is copied once into the arena and every
+* argument is a NUL terminated slice of that copy, so no argument is allocated on its own.
+* Quotes group words and are removed, a backslash escapes the next character (inside double quotes
+* only \\, ", $ and `), and the background sign is dropped.
+* A line with a glob or a brace also builds every word as a pattern, its quoted special characters
+* escaped, and the args are the words the patterns expand to.
+*/
+int _parseCommandLine(const char *cmd_line, CommandArena &arena, ArgsVector &args) {
     FUNC_ENTRY()
-    int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)));
-    for (std::string s; iss >> s;) {
-        args[i] = (char *) malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = nullptr;
+    size_t size = strlen(cmd_line) + 1;
+    char *line = arena.allocate(size);
+    memcpy(line, cmd_line, size);
+    _removeBackgroundSign(line);
+    bool expands = mayNeedExpansion(line);
+    string pattern;
+    vector<string> words;
+    //every argument is written over the text it was read from, so write never passes read
+    char *read = line, *write = line;
+    while (true) {
+        while (_isWhitespace(*read))
+            read++;
+        if (*read == '\0')
+            break;
+        char *word = write;
+        pattern.clear();
+        char quote = '\0';
+        while (*read && (quote || !_isWhitespace(*read))) {
+            if (quote == '\0' && (*read == '\'' || *read == '"')) {
+                quote = *read++;
+                continue;
+            }
+            if (quote != '\0' && *read == quote) {
+                quote = '\0';
+                read++;
+                continue;
+            }
+            bool isLiteral = quote != '\0';
+            if (*read == '\\' && read[1] && quote != '\'' &&
+                (quote == '\0' || strchr("\\\"$`", read[1]) != nullptr)) {
+                read++;
+                isLiteral = true;
+            }
+            if (expands) {
+                if (isLiteral && strchr(GLOB_SPECIAL_CHARS, *read) != nullptr)
+                    pattern += '\\';
+                pattern += *read;
+            }
+            *write++ = *read++;
+        }
+        if (*read)
+            read++;
+        *write++ = '\0';
+        if (!expands) {
+            args.push_back(word);
+            continue;
+        }
+        words.clear();
+        expandWord(pattern, words);
+        for (const string &expanded: words) {
+            char *arg = arena.allocate(expanded.size() + 1);
+            memcpy(arg, expanded.c_str(), expanded.size() + 1);
+            args.push_back(arg);
+        }
     }
-    return i;
+    return args.size();
 
     FUNC_EXIT()
 }
 
 
 bool _isBackgroundCommand(const char *cmd_line) {
-    const string str(cmd_line);
-    return str[str.find_last_not_of(WHITESPACE)] == '&';
+    const char *last = _lastNonWhitespace(cmd_line);
+    return last != nullptr && *last == '&';
 }
 
 void _removeBackgroundSign(char *cmd_line) {
-    const string str(cmd_line);
     // find last character other than spaces
-    unsigned int idx = str.find_last_not_of(WHITESPACE);
-    // if all characters are spaces then return
-    if (idx == string::npos) {
+    char *idx = (char *) _lastNonWhitespace(cmd_line);
+    // if all characters are spaces or the command line does not end with & then return
+    if (idx == nullptr || *idx != '&') {
         return;
     }
-    // if the command line does not end with & then return
-    if (cmd_line[idx] != '&') {
-        return;
+    // truncate the command line string at the background sign, and then remove all tailing spaces.
+    *idx = '\0';
+    idx = (char *) _lastNonWhitespace(cmd_line);
+    cmd_line[idx == nullptr ? 0 : idx - cmd_line + 1] = '\0';
+}
+
+/**
+* Everything CreateCommand needs to know about a line, found in a single pass over it: where its
+* first word is, and whether it has a pipe or a redirection outside of quotes.
+*/
+struct CommandLineScan {
+    const char *firstWord;
+    size_t length;
+    bool isPipe;
+    bool isRedirection;
+    bool isFanOut;
+};
+
+static void _scanCommandLine(const char *cmd_line, CommandLineScan &scan) {
+    const char *c = cmd_line;
+    while (_isWhitespace(*c))
+        c++;
+    scan.firstWord = c;
+    scan.length = strcspn(c, " \n\r\t\f\v&");
+    scan.isPipe = false;
+    scan.isRedirection = false;
+    scan.isFanOut = false;
+    //jumps between the characters that matter, with the same quoting rules as _parseCommandLine
+    char quote = '\0';
+    while ((c = strpbrk(c, quote == '\0' ? "'\"\\|>" : (quote == '"' ? "\"\\" : "'"))) != nullptr) {
+        if (*c == '\\') {
+            if (c[1])
+                c++;
+        } else if (quote != '\0') {
+            quote = '\0';
+        } else if (*c == '\'' || *c == '"') {
+            quote = *c;
+        } else if (*c == '|' && c[1] == '>') {
+            scan.isFanOut = true;
+            c++;
+        } else if (*c == '|') {
+            scan.isPipe = true;
+        } else {
+            scan.isRedirection = true;
+        }
+        c++;
     }
-    // replace the & (background sign) with space and then remove all tailing spaces.
-    cmd_line[idx] = ' ';
-    // truncate the command line string up to the last non-space character
-    cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
 }
 
-bool _isRedirectionCommand(const char *cmd_line) {
-    const string str(cmd_line);
-    return str.find(">") != string::npos || str.find(">>") != string::npos;
+//the position of the first c at or after start that is not quoted or escaped, npos when there is none
+static size_t _findUnquoted(const string &line, char c, size_t start) {
+    char quote = '\0';
+    for (size_t i = start; i < line.size(); i++) {
+        if (quote != '\0') {
+            if (line[i] == quote)
+                quote = '\0';
+            else if (line[i] == '\\' && quote == '"')
+                i++;
+        } else if (line[i] == '\'' || line[i] == '"') {
+            quote = line[i];
+        } else if (line[i] == '\\') {
+            i++;
+        } else if (line[i] == c) {
+            return i;
+        }
+    }
+    return string::npos;
 }
 
-bool _isPipeCommand(const char *cmd_line) {
-    const string str(cmd_line);
-    return str.find("|") != string::npos || str.find("|&") != string::npos;
+/**
+* Adds a launched job to the jobs list when it runs in the background, otherwise waits for it.
+*/
+static void _trackJob(Command *cmd, pid_t pgid) {
+    SmallShell &smash = SmallShell::getInstance();
+    if (_isBackgroundCommand(cmd->getCmdLine())) {
+        smash.getJobList()->addJob(cmd, smash.getJobList()->getJobIdToSet(), pgid, false);
+    } else {
+        smash.setForegroundPidFromFather(pgid);
+        smash.waitForeground(pgid);
+    }
 }
 
-SmallShell::SmallShell() : plastPwd(""), fgJobId(0) {
+SmallShell::SmallShell() : plastPwd(""), fgJobId(-1), signalFd(FAILURE), epollFd(FAILURE), lastStatus(0),
+                           failFast(false), interruptsCount(0), groupObserver(nullptr), inputReader(nullptr) {
     prompt = "smash";
     jobs = new JobsList();
+    hashTable = new PathHashTable();
+    timeouts = new TimeoutsList();
+    loadables = new LoadableBuiltins();
     currForegroundCommand = nullptr;
     pid = getpid();
 }
 
 SmallShell::~SmallShell() {
     delete jobs;
-    delete currForegroundCommand;
+    delete hashTable;
+    delete timeouts;
+    delete loadables;
+}
+
+/**
+* The factory of every built-in. They need the private state of SmallShell, hence the friend class.
+*/
+class BuiltinRegistry {
+public:
+    static Command *createPwd(const char *cmd_line, SmallShell &smash) {
+        return new GetCurrDirCommand(cmd_line);
+    }
+
+    static Command *createShowPid(const char *cmd_line, SmallShell &smash) {
+        return new ShowPidCommand(cmd_line);
+    }
+
+    static Command *createChprompt(const char *cmd_line, SmallShell &smash) {
+        return new ChangePromptCommand(cmd_line, &smash.prompt);
+    }
+
+    static Command *createCd(const char *cmd_line, SmallShell &smash) {
+        return new ChangeDirCommand(cmd_line, smash.plastPwd);
+    }
+
+    static Command *createKill(const char *cmd_line, SmallShell &smash) {
+        return new KillCommand(cmd_line, smash.jobs);
+    }
+
+    static Command *createJobs(const char *cmd_line, SmallShell &smash) {
+        return new JobsCommand(cmd_line, smash.jobs);
+    }
+
+    static Command *createFg(const char *cmd_line, SmallShell &smash) {
+        return new ForegroundCommand(cmd_line, smash.jobs);
+    }
+
+    static Command *createBg(const char *cmd_line, SmallShell &smash) {
+        return new BackgroundCommand(cmd_line, smash.jobs);
+    }
+
+    static Command *createQuit(const char *cmd_line, SmallShell &smash) {
+        return new QuitCommand(cmd_line, smash.jobs);
+    }
+
+    static Command *createTail(const char *cmd_line, SmallShell &smash) {
+        return new TailCommand(cmd_line);
+    }
+
+    static Command *createTouch(const char *cmd_line, SmallShell &smash) {
+        return new TouchCommand(cmd_line);
+    }
+
+    static Command *createHash(const char *cmd_line, SmallShell &smash) {
+        return new HashCommand(cmd_line, smash.hashTable);
+    }
+
+    static Command *createSet(const char *cmd_line, SmallShell &smash) {
+        return new SetCommand(cmd_line);
+    }
+
+    static Command *createExport(const char *cmd_line, SmallShell &smash) {
+        return new ExportCommand(cmd_line);
+    }
+
+    static Command *createTimeout(const char *cmd_line, SmallShell &smash) {
+        return new TimeoutCommand(cmd_line, smash.timeouts);
+    }
+
+    static Command *createAfter(const char *cmd_line, SmallShell &smash) {
+        return new AfterCommand(cmd_line, smash.jobs);
+    }
+
+    static Command *createEnable(const char *cmd_line, SmallShell &smash) {
+        return new EnableCommand(cmd_line, smash.loadables);
+    }
+
+    static Command *createTime(const char *cmd_line, SmallShell &smash) {
+        return new TimeCommand(cmd_line);
+    }
+
+    static Command *createBench(const char *cmd_line, SmallShell &smash) {
+        return new BenchCommand(cmd_line);
+    }
+
+    static Command *createStats(const char *cmd_line, SmallShell &smash) {
+        return new StatsCommand(cmd_line);
+    }
+
+    static Command *createParallel(const char *cmd_line, SmallShell &smash) {
+        return new ParallelCommand(cmd_line);
+    }
+};
+
+typedef Command *(*CommandFactory)(const char *cmd_line, SmallShell &smash);
+
+/**
+* What a built-in accepts after its name: between minArgs and maxArgs arguments (FAILURE for no
+* limit), where argument i has to be an int whenever bit i of numericArgs is set.
+*/
+struct BuiltinSchema {
+    int minArgs;
+    int maxArgs;
+    unsigned numericArgs;
+};
+
+struct Builtin {
+    const char *name;
+    size_t length;
+    CommandFactory create;
+    BuiltinSchema schema;
+    //the built-in takes the rest of the line as its command, pipes and redirections included
+    bool wrapsLine;
+};
+
+static constexpr size_t _constLength(const char *name) {
+    size_t length = 0;
+    while (name[length])
+        length++;
+    return length;
+}
+
+#define BUILTIN(name, factory, minArgs, maxArgs, numericArgs) \
+    {name, _constLength(name), &BuiltinRegistry::factory, {minArgs, maxArgs, numericArgs}, false}
+#define ARG(i) (1U << (i))
+
+static constexpr Builtin builtins[] = {
+        BUILTIN("pwd", createPwd, 0, FAILURE, 0),
+        BUILTIN("showpid", createShowPid, 0, FAILURE, 0),
+        BUILTIN("chprompt", createChprompt, 0, FAILURE, 0),
+        BUILTIN("cd", createCd, 1, FAILURE, 0),
+        BUILTIN("kill", createKill, 2, 2, ARG(1) | ARG(2)),
+        BUILTIN("jobs", createJobs, 0, FAILURE, 0),
+        BUILTIN("fg", createFg, 0, 1, ARG(1)),
+        BUILTIN("bg", createBg, 0, 1, ARG(1)),
+        BUILTIN("quit", createQuit, 0, FAILURE, 0),
+        BUILTIN("tail", createTail, 1, FAILURE, 0),
+        BUILTIN("touch", createTouch, 2, FAILURE, 0),
+        BUILTIN("hash", createHash, 0, FAILURE, 0),
+        BUILTIN("set", createSet, 1, 1, 0),
+        BUILTIN("export", createExport, 1, FAILURE, 0),
+        BUILTIN("enable", createEnable, 0, FAILURE, 0),
+        BUILTIN("stats", createStats, 0, 2, 0),
+        BUILTIN("parallel", createParallel, 1, FAILURE, 0),
+        {"after", _constLength("after"), &BuiltinRegistry::createAfter, {2, FAILURE, 0}, true},
+        {"timeout", _constLength("timeout"), &BuiltinRegistry::createTimeout, {2, FAILURE, 0}, true},
+        {"time", _constLength("time"), &BuiltinRegistry::createTime, {1, FAILURE, 0}, true},
+        {"bench", _constLength("bench"), &BuiltinRegistry::createBench, {3, FAILURE, 0}, true},
+};
+
+#define BUILTINS_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+//a power of two, about twice the number of built-ins so a perfect seed is found quickly
+#define BUILTINS_TABLE_SIZE (32)
+
+static constexpr unsigned _builtinHash(const char *name, size_t length, unsigned seed) {
+    unsigned hash = 2166136261U ^ seed;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619U;
+    return (hash ^ (hash >> 16)) & (BUILTINS_TABLE_SIZE - 1);
+}
+
+static constexpr bool _isPerfectSeed(unsigned seed) {
+    bool isUsed[BUILTINS_TABLE_SIZE] = {};
+    for (const Builtin &builtin: builtins) {
+        unsigned slot = _builtinHash(builtin.name, builtin.length, seed);
+        if (isUsed[slot])
+            return false;
+        isUsed[slot] = true;
+    }
+    return true;
+}
+
+static constexpr unsigned _findPerfectSeed() {
+    unsigned seed = 0;
+    while (!_isPerfectSeed(seed))
+        seed++;
+    return seed;
+}
+
+//the first seed that hashes every built-in to its own slot, found by the compiler
+static constexpr unsigned BUILTINS_SEED = _findPerfectSeed();
+
+struct BuiltinSlots {
+    int index[BUILTINS_TABLE_SIZE];
+};
+
+static constexpr BuiltinSlots _buildSlots() {
+    BuiltinSlots slots = {};
+    for (size_t i = 0; i < BUILTINS_TABLE_SIZE; i++)
+        slots.index[i] = FAILURE;
+    for (size_t i = 0; i < BUILTINS_COUNT; i++)
+        slots.index[_builtinHash(builtins[i].name, builtins[i].length, BUILTINS_SEED)] = i;
+    return slots;
+}
+
+static constexpr BuiltinSlots builtinSlots = _buildSlots();
+
+//a single hash and a single compare, nullptr when word is not a built-in
+static const Builtin *_findBuiltin(const char *word, size_t length) {
+    int index = builtinSlots.index[_builtinHash(word, length, BUILTINS_SEED)];
+    if (index == FAILURE)
+        return nullptr;
+    const Builtin &builtin = builtins[index];
+    return builtin.length == length && memcmp(builtin.name, word, length) == 0 ? &builtin : nullptr;
+}
+
+static bool _isInt(const char *arg) {
+    char *end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    return end != arg && *end == '\0' && errno == 0 && value >= INT_MIN && value <= INT_MAX;
+}
+
+static bool _matchesSchema(Command *cmd, const BuiltinSchema &schema) {
+    int argsCount = cmd->getArgsCount() - 1;
+    if (argsCount < schema.minArgs || (schema.maxArgs != FAILURE && argsCount > schema.maxArgs))
+        return false;
+    for (int i = 1; i <= argsCount && i < 32; i++) {
+        if ((schema.numericArgs & ARG(i)) && !_isInt(cmd->getArgs()[i]))
+            return false;
+    }
+    return true;
 }
 
 /**
 * Creates and returns a pointer to Command class which matches the given command line (cmd_line)
 */
 Command *SmallShell::CreateCommand(const char *cmd_line) {
-
-    string cmd_s = _trim(string(cmd_line));
-    string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n"));
-    size_t size = string(cmd_line).find_last_not_of(WHITESPACE) + 2;
-    char *built_in_cmd_line = new char[size];
-    memcpy(built_in_cmd_line, cmd_line, size);
-    if (_isBackgroundCommand(built_in_cmd_line))
-        _removeBackgroundSign(built_in_cmd_line);
-    if (_isPipeCommand(cmd_line)) {
+    StatsScope dispatch(STATS_DISPATCH);
+    CommandLineScan scan;
+    _scanCommandLine(cmd_line, scan);
+    const Builtin *builtin = _findBuiltin(scan.firstWord, scan.length);
+    bool wrapsLine = builtin != nullptr && builtin->wrapsLine;
+    if (scan.isFanOut && !wrapsLine)
+        return new FanOutCommand(cmd_line);
+    if (scan.isPipe && !wrapsLine)
         return new PipeCommand(cmd_line);
-    } else if (_isRedirectionCommand(cmd_line)) {
+    if (scan.isRedirection && !wrapsLine)
         return new RedirectionCommand(cmd_line);
-    }else if (firstWord.compare("pwd") == 0) {
-        return new GetCurrDirCommand(built_in_cmd_line);
-    } else if (firstWord.compare("showpid") == 0) {
-        return new ShowPidCommand(built_in_cmd_line);
-    } else if (firstWord.compare("chprompt") == 0) {
-        return new ChangePromptCommand(built_in_cmd_line, &prompt);
-    } else if (firstWord.compare("cd") == 0) {
-        return new ChangeDirCommand(built_in_cmd_line, plastPwd);
-    } else if (firstWord.compare("kill") == 0) {
-        return new KillCommand(built_in_cmd_line, jobs);
-    } else if (firstWord.compare("jobs") == 0) {
-        return new JobsCommand(built_in_cmd_line, jobs);
-    } else if (firstWord.compare("fg") == 0) {
-        return new ForegroundCommand(built_in_cmd_line, jobs);
-    } else if (firstWord.compare("bg") == 0) {
-        return new BackgroundCommand(built_in_cmd_line, jobs);
-    } else if (firstWord.compare("quit") == 0) {
-        return new QuitCommand(built_in_cmd_line, jobs);
-    } else if (firstWord.compare("tail") == 0) {
-        return new TailCommand(built_in_cmd_line);
-    } else if (firstWord.compare("touch") == 0) {
-        return new TouchCommand(built_in_cmd_line);
-    } else{
+    if (builtin == nullptr) {
+        const struct smash_builtin *plugin = nullptr;
+        if (!loadables->empty())
+            plugin = loadables->find(string(scan.firstWord, scan.length));
+        if (plugin != nullptr)
+            return new PluginCommand(cmd_line, plugin);
         return new ExternalCommand(cmd_line);
     }
+    //arguments are checked once here, a built-in only runs with arguments that match its schema
+    Command *cmd = builtin->create(cmd_line, *this);
+    if (!_matchesSchema(cmd, builtin->schema)) {
+        delete cmd;
+        return new InvalidArgumentsCommand(cmd_line);
+    }
+    return cmd;
+}
 
-    return nullptr;
+static StatsKind _statsKind(Command *cmd) {
+    if (dynamic_cast<PipeCommand *>(cmd) || dynamic_cast<FanOutCommand *>(cmd))
+        return STATS_PIPE;
+    if (dynamic_cast<RedirectionCommand *>(cmd))
+        return STATS_REDIRECTION;
+    if (dynamic_cast<PluginCommand *>(cmd))
+        return STATS_PLUGIN;
+    if (dynamic_cast<ExternalCommand *>(cmd))
+        return STATS_EXTERNAL;
+    return STATS_BUILTIN;
 }
 
 void SmallShell::executeCommand(const char *cmd_line) {
+    if (_lastNonWhitespace(cmd_line) == nullptr)
+        return;
+    lastStatus = 0;
+    StatsLineScope lineStats(cmd_line);
     Command *cmd = CreateCommand(cmd_line);
+    if (lineStats.isActive())
+        Stats::getInstance().setLineKind(_statsKind(cmd));
     if (dynamic_cast<BuiltInCommand *>(cmd))
         setJobToForeground(cmd);
     else if (!_isBackgroundCommand(cmd_line))
         setJobToForeground(cmd);
     cmd->execute();
+    resetForegroundJob();
+    //commands that became jobs are deleted by the jobs list once they finish
+    if (!jobs->ownsCommand(cmd))
+        delete cmd;
+}
+
+#define TIMER_EVENT_DATA ((uint64_t) FAILURE)
+
+void _markCommandFailed() {
+    SmallShell &smash = SmallShell::getInstance();
+    if (smash.getLastStatus() == 0)
+        smash.setLastStatus(1);
+}
+
+ssize_t LineReader::fill() {
+    //keep the unfinished line, and make room for a whole block after it
+    memmove(buffer.data(), buffer.data() + start, end - start);
+    end -= start;
+    start = 0;
+    if (end == buffer.size())
+        buffer.resize(2 * buffer.size());
+    ssize_t bytes = read(fd, buffer.data() + end, buffer.size() - end);
+    if (bytes > 0)
+        end += bytes;
+    return bytes;
+}
+
+bool SmallShell::readCommandLine(LineReader &reader, string &cmd_line) {
+    while (!reader.nextLine(cmd_line)) {
+        struct pollfd fds[2] = {{reader.getFd(), POLLIN, 0}, {epollFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == FAILURE) {
+            if (errno != EINTR)
+                perror("smash error: poll failed");
+            continue;
+        }
+        if (fds[1].revents & POLLIN)
+            handleEvents();
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        ssize_t bytes = reader.fill();
+        if (bytes == FAILURE && errno == EINTR)
+            continue;
+        if (bytes == FAILURE)
+            perror("smash error: read failed");
+        if (bytes <= 0)
+            return reader.lastLine(cmd_line);
+    }
+    return true;
+}
+
+int SmallShell::run(int fd, bool isInteractive) {
+    LineReader reader(fd, isInteractive ? STDIN_BLOCK_SIZE : SCRIPT_BLOCK_SIZE);
+    LineReader *outerReader = inputReader;
+    inputReader = &reader;
+    string cmd_line;
+    while (true) {
+        if (isInteractive) {
+            cout << prompt << "> ";
+            cout.flush();
+        }
+        if (!readCommandLine(reader, cmd_line))
+            break;
+        handleEvents();
+        executeCommand(cmd_line.c_str());
+        if (failFast && lastStatus != 0)
+            break;
+    }
+    inputReader = outerReader;
+    return lastStatus;
+}
+
+int _pidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return FAILURE;
+#endif
+}
+
+int _pidfdSendSignal(int pidfd, int sig, unsigned int flags) {
+#ifdef SYS_pidfd_send_signal
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, flags);
+#else
+    errno = ENOSYS;
+    return FAILURE;
+#endif
+}
+
+//the glibc wrapper drops the fifth argument of the system call, the usage
+int _waitidUsage(idtype_t idType, id_t id, siginfo_t *info, int options, struct rusage *usage) {
+    return syscall(SYS_waitid, idType, id, info, options, usage);
+}
 
+void ResourceUsage::add(const struct rusage &usage) {
+    userUs += usage.ru_utime.tv_sec * 1000000L + usage.ru_utime.tv_usec;
+    sysUs += usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec;
+    maxRssKb = max(maxRssKb, usage.ru_maxrss);
+    voluntarySwitches += usage.ru_nvcsw;
+    involuntarySwitches += usage.ru_nivcsw;
+    //the kernel counts block I/O of rusage in 512 bytes units
+    readBytes += usage.ru_inblock * 512;
+    writeBytes += usage.ru_oublock * 512;
+}
+
+void ResourceUsage::add(const ResourceUsage &other) {
+    userUs += other.userUs;
+    sysUs += other.sysUs;
+    maxRssKb = max(maxRssKb, other.maxRssKb);
+    voluntarySwitches += other.voluntarySwitches;
+    involuntarySwitches += other.involuntarySwitches;
+    readBytes += other.readBytes;
+    writeBytes += other.writeBytes;
+}
+
+//adds the value of every "key: value" line of a /proc file that appears in fields
+static void _readProcFields(const string &path, const map<string, long *> &fields) {
+    ifstream file(path);
+    string key;
+    long value;
+    while (file >> key) {
+        auto field = fields.find(key);
+        if (field != fields.end() && file >> value)
+            *field->second += value;
+        file.ignore(1 << 16, '\n');
+    }
+}
+
+bool ResourceUsage::sample(pid_t pid) {
+    string dir = "/proc/" + to_string(pid) + "/";
+    ifstream stat(dir + "stat");
+    string line;
+    if (!getline(stat, line))
+        return false;
+    //the command name may hold spaces and parentheses, the numeric fields start after the last ')'
+    size_t nameEnd = line.rfind(')');
+    if (nameEnd == string::npos)
+        return false;
+    istringstream fields(line.substr(nameEnd + 1));
+    string skipped;
+    //fields 3 to 13, from the state to cmajflt, come before utime and stime
+    for (int i = 3; i <= 13; i++)
+        fields >> skipped;
+    long utime = 0, stime = 0;
+    fields >> utime >> stime;
+    long tickUs = 1000000 / sysconf(_SC_CLK_TCK);
+    userUs += utime * tickUs;
+    sysUs += stime * tickUs;
+    long peakKb = 0;
+    _readProcFields(dir + "status", {{"VmHWM:",                   &peakKb},
+                                     {"voluntary_ctxt_switches:",    &voluntarySwitches},
+                                     {"nonvoluntary_ctxt_switches:", &involuntarySwitches}});
+    maxRssKb = max(maxRssKb, peakKb);
+    //io is only readable by the owner of the process, a job that changed its credentials reports no I/O
+    _readProcFields(dir + "io", {{"read_bytes:",  &readBytes},
+                                 {"write_bytes:", &writeBytes}});
+    return true;
+}
+
+void SmallShell::setSignalFd(int fd) {
+    signalFd = fd;
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == FAILURE)
+        SYS_CALL_ERROR_MESSAGE("epoll_create1");
+    //event data 0 is the signalfd, TIMER_EVENT_DATA the timeouts timerfd, any other value is the
+    //process group id of a job's pidfd
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event) == FAILURE)
+        SYS_CALL_ERROR_MESSAGE("epoll_ctl");
+    jobs->setEpollFd(epollFd);
+    event.data.u64 = TIMER_EVENT_DATA;
+    if (timeouts->getTimerFd() != FAILURE && epoll_ctl(epollFd, EPOLL_CTL_ADD, timeouts->getTimerFd(), &event) == FAILURE)
+        SYS_CALL_ERROR_MESSAGE("epoll_ctl");
+}
+
+void SmallShell::handleEvents() {
+    struct epoll_event events[64];
+    int count;
+    while ((count = epoll_wait(epollFd, events, 64, 0)) > 0) {
+        for (int i = 0; i < count; i++) {
+            uint64_t expirations;
+            if (events[i].data.u64 == 0)
+                handleSignals(signalFd);
+            else if (events[i].data.u64 == TIMER_EVENT_DATA) {
+                //nothing to read when the timer was rearmed since it became readable
+                if (read(timeouts->getTimerFd(), &expirations, sizeof(expirations)) == sizeof(expirations))
+                    alarmHandler(SIGALRM);
+            } else
+                onJobPidfdReady(events[i].data.u64);
+        }
+    }
+}
+
+void SmallShell::onChildStateChange(pid_t childPid, int status, const struct rusage *usage) {
+    pid_t pgid = jobs->getProcessGroup(childPid);
+    if (pgid == FAILURE)
+        return;
+    bool isForeground = currForegroundCommand != nullptr && currForegroundCommand->getPid() == pgid;
+    JobsList::JobEntry *job = jobs->getJobByPid(pgid);
+    if (WIFSTOPPED(status)) {
+        if (isForeground) {
+            //stopped by someone else than ctrl-Z, it still becomes a stopped job
+            jobs->addJob(currForegroundCommand, fgJobId == -1 ? jobs->getJobIdToSet() : fgJobId, pgid, true);
+            resetForegroundJob();
+        } else if (job != nullptr) {
+            jobs->setJobStopped(job, true);
+        }
+    } else if (WIFCONTINUED(status)) {
+        if (job != nullptr)
+            jobs->setJobStopped(job, false);
+    } else {
+        //a foreground line fails when any of its processes fails, like bash with pipefail
+        if (isForeground && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+            lastStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (isForeground && usage != nullptr)
+            foregroundUsage.add(*usage);
+        if (job != nullptr && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+            job->setFailed();
+        bool isLast = jobs->removeProcess(childPid, usage);
+        if (groupObserver != nullptr)
+            groupObserver->onProcessExit(pgid, status, isLast);
+        if (!isLast)
+            return;
+        timeouts->cancel(pgid);
+        if (isForeground) {
+            //a job brought back with fg still starts the jobs waiting on it
+            int jobId = fgJobId;
+            resetForegroundJob();
+            if (jobId != -1)
+                onJobFinished(jobId, lastStatus == 0);
+        } else if (job != nullptr) {
+            int jobId = job->getJobId();
+            bool succeeded = !job->isFailed();
+            jobs->removeJobById(jobId);
+            onJobFinished(jobId, succeeded);
+        }
+    }
+}
+
+void SmallShell::onJobFinished(int jobId, bool succeeded) {
+    for (int pendingId: jobs->takeDependents(jobId)) {
+        //canceling an earlier dependent may have canceled this one already
+        JobsList::PendingJob *pending = jobs->getPendingJob(pendingId);
+        if (pending == nullptr)
+            continue;
+        if (!succeeded) {
+            jobs->removePendingJob(pendingId);
+            cout << "smash: job " << pendingId << " canceled, job " << jobId << " did not succeed" << endl;
+            onJobFinished(pendingId, false);
+        } else if (pending->waitingOn.empty()) {
+            startPendingJob(pendingId);
+        }
+    }
+}
+
+void SmallShell::startPendingJob(int jobId) {
+    string cmd_line = jobs->removePendingJob(jobId);
+    //the job starts while smash handles events, in the middle of a line that keeps its own status
+    int lineStatus = lastStatus;
+    lastStatus = 0;
+    Command *cmd = CreateCommand(cmd_line.c_str());
+    pid_t pgid = cmd->launch();
+    int jobStatus = lastStatus;
+    lastStatus = lineStatus;
+    if (pgid != FAILURE) {
+        jobs->addJob(cmd, jobId, pgid);
+        return;
+    }
+    //a built-in is already done, and so is a command that could not start
+    delete cmd;
+    onJobFinished(jobId, jobStatus == 0);
+}
+
+void SmallShell::onJobPidfdReady(pid_t pgid) {
+    JobsList::JobEntry *job = jobs->getJobByPid(pgid);
+    if (job == nullptr || job->getPidfd() == FAILURE)
+        return;
+    StatsScope reap(STATS_REAP);
+    siginfo_t info = {};
+    struct rusage usage = {};
+    int ret = _waitidUsage(P_PIDFD, job->getPidfd(), &info, WEXITED | WNOHANG, &usage);
+    //the leader is gone either way: reaped right now, or already reaped through SIGCHLD
+    jobs->closeJobPidfd(job);
+    if (ret == FAILURE && errno == EINVAL) {
+        reapChildren();
+        return;
+    }
+    if (ret == FAILURE || info.si_pid == 0)
+        return;
+    int status = info.si_code == CLD_EXITED ? W_EXITCODE(info.si_status, 0) : info.si_status;
+    onChildStateChange(info.si_pid, status, &usage);
+}
+
+void SmallShell::reapChildren() {
+    StatsScope reap(STATS_REAP);
+    int status;
+    struct rusage usage;
+    pid_t childPid;
+    while ((childPid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+        onChildStateChange(childPid, status, WIFEXITED(status) || WIFSIGNALED(status) ? &usage : nullptr);
+}
+
+void SmallShell::onTimeoutsExpired() {
+    TimeoutsList::TimeoutEntry timeout;
+    while (timeouts->popExpired(&timeout)) {
+        JobsList::JobEntry *job = jobs->getJobByPid(timeout.pgid);
+        int ret;
+        if (job != nullptr)
+            ret = jobs->signalJob(job, SIGKILL, true);
+        else if (jobs->isGroupAlive(timeout.pgid))
+            //the foreground job, its group is safe to signal until smash reaps it
+            ret = killpg(timeout.pgid, SIGKILL);
+        else
+            continue;
+        if (ret == FAILURE) {
+            perror("smash error: kill failed");
+            continue;
+        }
+        cout << "smash: " << timeout.cmd_line << " timed out!" << endl;
+    }
+}
+
+void SmallShell::waitForeground(pid_t pgid) {
+    StatsScope wait(STATS_WAIT);
+    //a built-in pipe stage that handled events, like parallel, may have reaped the whole group already
+    while (currForegroundCommand != nullptr && currForegroundCommand->getPid() == pgid && jobs->isGroupAlive(pgid)) {
+        struct pollfd pfd = {epollFd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) == FAILURE && errno != EINTR)
+            SYS_CALL_ERROR_MESSAGE("poll");
+        handleEvents();
+    }
 }
 
 void ChangePromptCommand::execute() {
@@ -186,30 +887,116 @@ void ChangeDirCommand::execute() {
 }
 
 void KillCommand::execute() {
-    if (getArgsCount() != 3 || stoi(string(getArgs()[1])) >= 0)
+    if (stoi(string(getArgs()[1])) >= 0)
         PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
     int sigNum = stoi(string(getArgs()[1]));
     sigNum *= (FAILURE);
     int jobId = stoi(string(getArgs()[2]));
     if (!jobs->jobExist(jobId))
-        PRINT_SMASH_ERROR_AND_RETURN("job-id" + to_string(jobId) + "does not exist");
-    int pid = jobs->getJobById(jobId)->getProcessId();
-    if (kill(pid, sigNum) == FAILURE)
+        PRINT_SMASH_ERROR_AND_RETURN("job-id " + to_string(jobId) + " does not exist");
+    JobsList::JobEntry *job = jobs->getJobById(jobId);
+    int pid = job->getProcessId();
+    if (jobs->signalJob(job, sigNum, true) == FAILURE)
         SYS_CALL_ERROR_MESSAGE("kill");
     cout << "signal number " << sigNum << " was sent to pid " << pid << endl;
 }
 
+void StatsCommand::execute() {
+    Stats &stats = Stats::getInstance();
+    string option = getArgsCount() > 1 ? getArgs()[1] : "";
+    if (getArgsCount() == 1)
+        stats.print();
+    else if (option == "on" && getArgsCount() == 2)
+        statsEnabled = true;
+    else if (option == "off" && getArgsCount() == 2)
+        statsEnabled = false;
+    else if (option == "reset" && getArgsCount() == 2)
+        stats.reset();
+    else if (option == "trace" && getArgsCount() == 3 && strcmp(getArgs()[2], "off") == 0)
+        stats.stopTrace();
+    else if (option == "trace" && getArgsCount() == 3) {
+        if (!stats.startTrace(getArgs()[2]))
+            SYS_CALL_ERROR_MESSAGE("open");
+        //a trace without timings would be empty
+        statsEnabled = true;
+    } else
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+}
+
 void JobsCommand::execute() {
-    if (jobs->empty())
-        return;
-    jobs->removeFinishedJobs();
-    jobs->printJobsList();
+    SmallShell::getInstance().reapChildren();
+    string option = getArgsCount() > 1 ? getArgs()[1] : "";
+    if (option == "-v" || option == "--json")
+        jobs->printJobsUsage(option == "--json");
+    else
+        jobs->printJobsList();
+}
+
+static string _jsonString(const string &text) {
+    string ret = "\"";
+    for (char c: text) {
+        if (c == '"' || c == '\\')
+            ret += '\\';
+        if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            ret += escaped;
+        } else
+            ret += c;
+    }
+    return ret + "\"";
+}
+
+static string _seconds(long us) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.2fs", us / 1e6);
+    return text;
+}
+
+void JobsList::printJobsUsage(bool asJson) {
+    unordered_map<pid_t, ResourceUsage> usages;
+    for (auto &entry: orderedJobs) {
+        pid_t pgid = entry.second->getProcessId();
+        auto reaped = groupUsages.find(pgid);
+        usages[pgid] = reaped == groupUsages.end() ? ResourceUsage() : reaped->second;
+    }
+    //a single pass over the live processes samples every job, pipelines included
+    for (auto &process: processGroups) {
+        auto usage = usages.find(process.second);
+        if (usage != usages.end())
+            usage->second.sample(process.first);
+    }
+    if (asJson)
+        cout << "[";
+    const char *separator = "";
+    for (auto &entry: orderedJobs) {
+        JobEntry *job = entry.second;
+        ResourceUsage &usage = usages[job->getProcessId()];
+        long seconds = difftime(time(nullptr), job->getTime());
+        if (asJson) {
+            cout << separator << "{\"job_id\":" << job->getJobId() << ",\"cmd_line\":" << _jsonString(job->getCmdLine())
+                 << ",\"pid\":" << job->getProcessId() << ",\"seconds\":" << seconds << ",\"stopped\":"
+                 << (job->isStoppedJob() ? "true" : "false") << ",\"user_us\":" << usage.userUs << ",\"sys_us\":"
+                 << usage.sysUs << ",\"max_rss_kb\":" << usage.maxRssKb << ",\"voluntary_switches\":"
+                 << usage.voluntarySwitches << ",\"involuntary_switches\":" << usage.involuntarySwitches
+                 << ",\"read_bytes\":" << usage.readBytes << ",\"write_bytes\":" << usage.writeBytes << "}";
+            separator = ",";
+            continue;
+        }
+        cout << "[" << job->getJobId() << "] " << job->getCmdLine() << " : " << job->getProcessId() << " " << seconds
+             << " secs ";
+        if (job->isStoppedJob())
+            cout << "(stopped) ";
+        cout << "user " << _seconds(usage.userUs) << " sys " << _seconds(usage.sysUs) << " maxrss "
+             << usage.maxRssKb << "KB csw " << usage.voluntarySwitches << "/" << usage.involuntarySwitches
+             << " read " << usage.readBytes << "B write " << usage.writeBytes << "B" << endl;
+    }
+    if (asJson)
+        cout << "]" << endl;
 }
 
 void ForegroundCommand::execute() {
     JobsList::JobEntry *currJob;
-    if (getArgsCount() > 2 || getArgsCount() == 0)
-        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
     if (getArgsCount() == 1) {
         if (jobs->empty())
             PRINT_SMASH_ERROR_AND_RETURN("jobs list is empty");
@@ -219,86 +1006,608 @@ void ForegroundCommand::execute() {
         currJob = jobs->getJobById(jobId);
         if (currJob == nullptr) {
             cerr << "smash error: fg: job-id " << jobId << " does not exists" << endl;
+            _markCommandFailed();
             return;
         }
     }
     pid_t pid = currJob->getProcessId();
-    SmallShell &smash = SmallShell::getInstance();
-    smash.setJobToForeground(currJob->getCommand(), currJob->getJobId());
+    int jobId = currJob->getJobId();
     cout << currJob->getCmdLine() << " : " << pid << endl;
-    if (killpg(pid, SIGCONT) == FAILURE)
+    if (jobs->signalJob(currJob, SIGCONT, true) == FAILURE)
         SYS_CALL_ERROR_MESSAGE("kill");
-    if (waitpid(pid, nullptr, WUNTRACED) == FAILURE)
-        SYS_CALL_ERROR_MESSAGE("waitpid");
-    assert(currJob);
-    assert(jobs);
-    jobs->removeJobById(currJob->getJobId());
+    //the job leaves the list while it runs in the foreground, ctrl-Z puts it back with the same id
+    Command *cmd = jobs->releaseJob(jobId);
+    SmallShell &smash = SmallShell::getInstance();
+    smash.setJobToForeground(cmd, jobId);
+    smash.waitForeground(pid);
+    smash.resetForegroundJob();
+    if (!jobs->ownsCommand(cmd))
+        delete cmd;
 }
 
 void BackgroundCommand::execute() {
-    if (getArgsCount() > 2 || getArgsCount() == 0)
-        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
     JobsList::JobEntry *job;
     if (getArgsCount() == 1) {
-        int *jobId;
-        job = jobs->getLastStoppedJob(jobId);
+        int jobId;
+        job = jobs->getLastStoppedJob(&jobId);
         if (job == nullptr)
             PRINT_SMASH_ERROR_AND_RETURN("there is no stopped jobs to resume");
     } else {
         job = jobs->getJobById(stoi(string((getArgs()[1]))));
         if (job == nullptr) {
             cerr << "smash error: bg: job-id " << getArgs()[1] << " does not exist" << endl;
+            _markCommandFailed();
             return;
         }
         if (!job->isStoppedJob()) {
             cerr << "smash error: bg: job-id " << getArgs()[1] << " is already running in the background" << endl;
+            _markCommandFailed();
             return;
         }
     }
     cout << job->getCmdLine() << " : " << job->getProcessId() << endl;
-    if (kill(job->getProcessId(), SIGCONT) == FAILURE)
+    if (jobs->signalJob(job, SIGCONT, true) == FAILURE)
         SYS_CALL_ERROR_MESSAGE("kill");
-    job->setNotStopped();
+    jobs->setJobStopped(job, false);
+}
+
+string LoadableBuiltins::load(const string &path, const string &name) {
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+        return dlerror();
+    string symbol = SMASH_BUILTIN_SYMBOL_PREFIX + name;
+    auto *builtin = (const struct smash_builtin *) dlsym(handle, symbol.c_str());
+    string error;
+    if (builtin == nullptr)
+        error = name + ": " + symbol + " not found in " + path;
+    else if (builtin->abi_version != SMASH_PLUGIN_ABI_VERSION)
+        error = name + ": ABI version " + to_string(builtin->abi_version) + " is not supported";
+    else if (builtin->run == nullptr)
+        error = name + ": no entry point";
+    if (!error.empty()) {
+        dlclose(handle);
+        return error;
+    }
+    //loading a name again replaces it
+    unload(name);
+    table[name] = {path, handle, builtin};
+    return "";
+}
+
+bool LoadableBuiltins::unload(const string &name) {
+    auto loaded = table.find(name);
+    if (loaded == table.end())
+        return false;
+    dlclose(loaded->second.handle);
+    table.erase(loaded);
+    return true;
+}
+
+void LoadableBuiltins::printTable() {
+    for (auto &loaded: table)
+        cout << "enable -f " << loaded.second.path << " " << loaded.first << endl;
+}
+
+void EnableCommand::execute() {
+    if (getArgsCount() == 1) {
+        loadables->printTable();
+        return;
+    }
+    string option = getArgs()[1];
+    if ((option != "-f" || getArgsCount() < 4) && (option != "-d" || getArgsCount() < 3))
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    for (int i = option == "-f" ? 3 : 2; i < getArgsCount(); i++) {
+        string name = getArgs()[i];
+        if (option == "-d") {
+            if (!loadables->unload(name))
+                PRINT_SMASH_ERROR_AND_RETURN(name + ": not a loadable built-in");
+        } else if (_findBuiltin(name.c_str(), name.size()) != nullptr) {
+            PRINT_SMASH_ERROR_AND_RETURN(name + ": is a shell built-in");
+        } else {
+            string error = loadables->load(getArgs()[2], name);
+            if (!error.empty())
+                PRINT_SMASH_ERROR_AND_RETURN(error);
+        }
+    }
+}
+
+void PluginCommand::execute() {
+    //the plugin writes through stdio, which cout shares its buffer with
+    cout.flush();
+    int status = builtin->run(getArgsCount(), getArgs());
+    fflush(stdout);
+    fflush(stderr);
+    if (status != 0)
+        SmallShell::getInstance().setLastStatus(status);
+}
+
+void InvalidArgumentsCommand::execute() {
+    PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+}
+
+void SetCommand::execute() {
+    if (strcmp(getArgs()[1], "-e") != 0 && strcmp(getArgs()[1], "+e") != 0)
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    SmallShell::getInstance().setFailFast(getArgs()[1][0] == '-');
+}
+
+void ExportCommand::execute() {
+    //nothing is exported unless every assignment is valid
+    for (int i = 1; i < getArgsCount(); i++) {
+        const char *equals = strchr(getArgs()[i], '=');
+        if (equals == nullptr || equals == getArgs()[i])
+            PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    }
+    for (int i = 1; i < getArgsCount(); i++) {
+        const char *equals = strchr(getArgs()[i], '=');
+        setenv(string(getArgs()[i], equals - getArgs()[i]).c_str(), equals + 1, 1);
+    }
 }
 
 void QuitCommand::execute() {
-    if (getArgsCount() > 1 && string(getArgs()[1]).compare("kill"))
+    if (getArgsCount() > 1 && string(getArgs()[1]).compare("kill") == 0) {
+        SmallShell::getInstance().reapChildren();
         jobs->killAllJobs();
+    }
     exit(0);
 }
 
-void ExternalCommand::execute() {
-    pid_t pid = fork();
+//characters that need bash to be interpreted (expansions, control operators), smash parses quotes and globs itself
+const std::string SHELL_SPECIAL_CHARS = "~$`;&|()<>#!\n";
+
+bool _isSimpleCommandLine(const char *cmd_line) {
+    const char *background = _isBackgroundCommand(cmd_line) ? _lastNonWhitespace(cmd_line) : nullptr;
+    const char *c = cmd_line;
+    while (_isWhitespace(*c))
+        c++;
+    //a leading "VAR=value" is an environment assignment
+    if (memchr(c, '=', strcspn(c, WHITESPACE.c_str())) != nullptr)
+        return false;
+    for (; *c; c++) {
+        if (c != background && strchr(SHELL_SPECIAL_CHARS.c_str(), *c) != nullptr)
+            return false;
+    }
+    return true;
+}
+
+static void _closeFds(vector<int> &fds) {
+    for (int &fd: fds) {
+        if (fd != FAILURE)
+            close(fd);
+        fd = FAILURE;
+    }
+}
+
+/**
+* Launches the process in its own process group using posix_spawn (vfork+exec under the hood), so the
+* smash address space is never copied. extraFds[i] becomes fd 3 + i of the new process.
+* Returns the pid of the new process or FAILURE with errno set.
+*/
+static pid_t _posixSpawn(const char *path, char *const argv[], pid_t pgid, int inFd, int outFd, int errFd,
+                         const vector<int> &extraFds) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (inFd != FAILURE)
+        posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    if (outFd != FAILURE)
+        posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    if (errFd != FAILURE)
+        posix_spawn_file_actions_adddup2(&actions, errFd, STDERR_FILENO);
+    //the extra fds are copied above their targets first, so a dup2 never replaces one still to be used
+    vector<int> moved;
+    for (size_t i = 0; i < extraFds.size(); i++) {
+        int fd = fcntl(extraFds[i], F_DUPFD_CLOEXEC, STDERR_FILENO + 1 + extraFds.size());
+        if (fd == FAILURE) {
+            int err = errno;
+            _closeFds(moved);
+            posix_spawn_file_actions_destroy(&actions);
+            errno = err;
+            return FAILURE;
+        }
+        moved.push_back(fd);
+        posix_spawn_file_actions_adddup2(&actions, fd, STDERR_FILENO + 1 + i);
+    }
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    //smash blocks the signals it reads through its signalfd, the new process must not inherit that
+    sigset_t emptyMask;
+    sigemptyset(&emptyMask);
+    //nor SIGPIPE, which smash ignores while it launches pipe stages and survives exec
+    sigset_t defaultSignals;
+    sigemptyset(&defaultSignals);
+    sigaddset(&defaultSignals, SIGPIPE);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &emptyMask);
+    posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    _closeFds(moved);
+    if (err != 0) {
+        errno = err;
+        return FAILURE;
+    }
+    return pid;
+}
+
+/**
+* Launches path into process group pgid (0 for a new group) with the given fds (FAILURE keeps smash's
+* own) through the zygote, or by smash itself when the zygote is not running.
+*/
+static pid_t _spawnProcess(const char *path, char *const argv[], pid_t pgid, int inFd, int outFd, int errFd,
+                           const vector<int> &extraFds = vector<int>()) {
+    StatsScope spawn(STATS_SPAWN);
+    Zygote &zygote = Zygote::getInstance();
+    pid_t pid = FAILURE;
+    //more fds than a single message of the zygote carries are passed by smash itself
+    bool useZygote = extraFds.size() <= ZYGOTE_MAX_EXTRA_FDS;
+    if (useZygote && zygote.isRunning())
+        pid = zygote.spawn(path, argv, pgid, inFd, outFd, errFd, extraFds);
+    //not started, or gone while handling this very request
+    if (!useZygote || !zygote.isRunning())
+        pid = _posixSpawn(path, argv, pgid, inFd, outFd, errFd, extraFds);
     if (pid == FAILURE)
-        SYS_CALL_ERROR_MESSAGE("fork");
-    if (pid == 0) {
-        setpgrp();
-        setPid();
-        char *argv[4];
-        char new_cmd_line[COMMAND_ARGS_MAX_LENGTH];
-        strcpy(new_cmd_line, getCmdLineAsString().c_str());
+        return FAILURE;
+    SmallShell::getInstance().getJobList()->addProcess(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+pid_t ExternalCommand::spawn(pid_t pgid, int inFd, int outFd, int errFd) {
+    pid_t pid;
+    if (!_isSimpleCommandLine(getCmdLine())) {
+        char *new_cmd_line = new char[strlen(getCmdLine()) + 1];
+        strcpy(new_cmd_line, getCmdLine());
         _removeBackgroundSign(new_cmd_line);
-        argv[2] = new_cmd_line;
-        argv[3] = nullptr;
-        argv[0] = (char *) malloc(10);
-        strcpy(argv[0], "/bin/bash");
-        argv[1] = (char *) malloc(3);
-        strcpy(argv[1], "-c");
-        if (execv(argv[0], argv) == FAILURE)
-            SYS_CALL_ERROR_MESSAGE("execv");
-        free(argv[0]);
-        free(argv[1]);
+        //** has to mean what it means to smash's own globs
+        char bash[] = "/bin/bash", option[] = "-O", globstar[] = "globstar", flag[] = "-c";
+        char *argv[] = {bash, option, globstar, flag, new_cmd_line, nullptr};
+        pid = _spawnProcess(argv[0], argv, pgid, inFd, outFd, errFd);
+        delete[] new_cmd_line;
+        if (pid == FAILURE) {
+            perror("smash error: execv failed");
+            _markCommandFailed();
+        }
+        return pid;
+    }
+    PathHashTable *hashTable = SmallShell::getInstance().getHashTable();
+    string path = hashTable->lookup(getName());
+    if (path.empty()) {
+        errno = ENOENT;
+        perror("smash error: execv failed");
+        _markCommandFailed();
+        return FAILURE;
+    }
+    pid = _spawnProcess(path.c_str(), getArgs(), pgid, inFd, outFd, errFd);
+    if (pid == FAILURE && errno == ENOENT && getName().find('/') == string::npos) {
+        //the cached path went stale, resolve it again through PATH
+        hashTable->forget(getName());
+        path = hashTable->lookup(getName());
+        if (!path.empty())
+            pid = _spawnProcess(path.c_str(), getArgs(), pgid, inFd, outFd, errFd);
+    }
+    if (pid == FAILURE) {
+        perror("smash error: execv failed");
+        _markCommandFailed();
+    }
+    return pid;
+}
+
+void ExternalCommand::execute() {
+    pid_t pid = launch();
+    if (pid == FAILURE)
+        return;
+    _trackJob(this, pid);
+}
+
+static long long _monotonicNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//the rest of line after its first count words
+static const char *_skipWords(const char *line, int count) {
+    for (int word = 0; word < count; word++) {
+        line += strspn(line, WHITESPACE.c_str());
+        line += strcspn(line, WHITESPACE.c_str());
+    }
+    return line + strspn(line, WHITESPACE.c_str());
+}
+
+TimeoutsList::TimeoutsList() : nextId(0) {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd == FAILURE)
+        perror("smash error: timerfd_create failed");
+}
+
+void TimeoutsList::addTimeout(pid_t pgid, double seconds, const string &cmd_line) {
+    TimeoutEntry timeout = {_monotonicNs() + (long long) (seconds * 1e9), nextId++, pgid, cmd_line};
+    activeIds[pgid] = timeout.id;
+    deadlines.push(timeout);
+    if (deadlines.top().id == timeout.id)
+        arm();
+}
+
+bool TimeoutsList::popExpired(TimeoutEntry *entry) {
+    long long now = _monotonicNs();
+    while (!deadlines.empty()) {
+        const TimeoutEntry &top = deadlines.top();
+        auto active = activeIds.find(top.pgid);
+        if (active != activeIds.end() && active->second == top.id) {
+            if (top.deadline > now)
+                break;
+            activeIds.erase(active);
+            *entry = top;
+            deadlines.pop();
+            return true;
+        }
+        deadlines.pop();
+    }
+    arm();
+    return false;
+}
+
+void TimeoutsList::arm() {
+    while (!deadlines.empty()) {
+        auto active = activeIds.find(deadlines.top().pgid);
+        if (active != activeIds.end() && active->second == deadlines.top().id)
+            break;
+        deadlines.pop();
+    }
+    //an all zero value disarms the timer
+    struct itimerspec spec = {};
+    if (!deadlines.empty()) {
+        spec.it_value.tv_sec = deadlines.top().deadline / 1000000000LL;
+        spec.it_value.tv_nsec = deadlines.top().deadline % 1000000000LL;
+    }
+    if (timerFd != FAILURE && timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == FAILURE)
+        perror("smash error: timerfd_settime failed");
+}
+
+void TimeoutCommand::execute() {
+    char *end = nullptr;
+    double seconds = strtod(getArgs()[1], &end);
+    if (*end != '\0' || !(seconds > 0))
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    //the bounded command is the rest of the line after the duration, background sign included
+    Command *cmd = SmallShell::getInstance().CreateCommand(_skipWords(getCmdLine(), 2));
+    pid_t pgid = cmd->launch();
+    delete cmd;
+    if (pgid == FAILURE)
+        return;
+    timeouts->addTimeout(pgid, seconds, getCmdLineAsString());
+    _trackJob(this, pgid);
+}
+
+void AfterCommand::execute() {
+    set<int> waitingOn;
+    int words = 1;
+    for (; words < getArgsCount() && _isInt(getArgs()[words]); words++)
+        waitingOn.insert(stoi(string(getArgs()[words])));
+    if (words < getArgsCount() && strcmp(getArgs()[words], "--") == 0)
+        words++;
+    if (waitingOn.empty() || words == getArgsCount())
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    for (int jobId: waitingOn) {
+        if (!jobs->jobExist(jobId) && !jobs->pendingJobExist(jobId))
+            PRINT_SMASH_ERROR_AND_RETURN("job-id " + to_string(jobId) + " does not exist");
+    }
+    //the rest of the line is kept as typed, it is parsed only once the job starts
+    jobs->addPendingJob(jobs->getJobIdToSet(), _skipWords(getCmdLine(), words), waitingOn);
+}
+
+struct CommandTimes {
+    double wallUs;
+    long userUs;
+    long sysUs;
+};
+
+static long _timevalUs(const struct timeval &tv) {
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/**
+ * Runs cmd_line exactly as smash runs a line it read. The CPU times are those of smash itself, which
+ * covers built-ins, plus those of the foreground processes it reaped meanwhile.
+ */
+static CommandTimes _timeCommand(const char *cmd_line) {
+    SmallShell &smash = SmallShell::getInstance();
+    struct rusage before, after;
+    smash.takeForegroundUsage();
+    getrusage(RUSAGE_SELF, &before);
+    long long start = _monotonicNs();
+    smash.executeCommand(cmd_line);
+    CommandTimes times;
+    times.wallUs = (_monotonicNs() - start) / 1e3;
+    getrusage(RUSAGE_SELF, &after);
+    ResourceUsage children = smash.takeForegroundUsage();
+    times.userUs = _timevalUs(after.ru_utime) - _timevalUs(before.ru_utime) + children.userUs;
+    times.sysUs = _timevalUs(after.ru_stime) - _timevalUs(before.ru_stime) + children.sysUs;
+    return times;
+}
+
+static string _duration(double us) {
+    char text[32];
+    if (us < 1e3)
+        snprintf(text, sizeof(text), "%.1fus", us);
+    else if (us < 1e6)
+        snprintf(text, sizeof(text), "%.3fms", us / 1e3);
+    else
+        snprintf(text, sizeof(text), "%.3fs", us / 1e6);
+    return text;
+}
+
+void TimeCommand::execute() {
+    CommandTimes times = _timeCommand(_skipWords(getCmdLine(), 1));
+    cerr << "real " << _duration(times.wallUs) << endl << "user " << _duration(times.userUs) << endl << "sys "
+         << _duration(times.sysUs) << endl;
+}
+
+//nearest rank percentile of sorted samples
+static double _percentile(const vector<double> &sorted, double percent) {
+    size_t rank = (size_t) ceil(percent / 100 * sorted.size());
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+static void _printBenchSummary(vector<double> &samples, long userUs, long sysUs) {
+    sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double sample: samples)
+        sum += sample;
+    double mean = sum / samples.size();
+    double squares = 0;
+    for (double sample: samples)
+        squares += (sample - mean) * (sample - mean);
+    double stddev = samples.size() > 1 ? sqrt(squares / (samples.size() - 1)) : 0;
+    //Tukey's fences: anything further than 1.5 interquartile ranges from the middle half is an outlier
+    double q1 = _percentile(samples, 25), q3 = _percentile(samples, 75);
+    double low = q1 - 1.5 * (q3 - q1), high = q3 + 1.5 * (q3 - q1);
+    long outliers = 0;
+    for (double sample: samples)
+        outliers += sample < low || sample > high;
+    cout << samples.size() << " runs: mean " << _duration(mean) << " stddev " << _duration(stddev) << endl
+         << "min " << _duration(samples.front()) << " p50 " << _duration(_percentile(samples, 50)) << " p99 "
+         << _duration(_percentile(samples, 99)) << " max " << _duration(samples.back()) << endl
+         << "user " << _duration((double) userUs / samples.size()) << " sys "
+         << _duration((double) sysUs / samples.size()) << " per run" << endl;
+    if (outliers > 0)
+        cout << outliers << " outliers (" << 100 * outliers / samples.size()
+             << "%), the runs may have been disturbed" << endl;
+}
+
+void BenchCommand::execute() {
+    long runs = 0, warmup = 0;
+    int word = 1;
+    while (word + 1 < getArgsCount() && (strcmp(getArgs()[word], "-n") == 0 || strcmp(getArgs()[word], "-w") == 0)) {
+        if (!_isInt(getArgs()[word + 1]))
+            PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+        (getArgs()[word][1] == 'n' ? runs : warmup) = stol(getArgs()[word + 1]);
+        word += 2;
+    }
+    if (runs <= 0 || warmup < 0 || word == getArgsCount())
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    const char *cmd_line = _skipWords(getCmdLine(), word);
+    SmallShell &smash = SmallShell::getInstance();
+    vector<double> samples;
+    samples.reserve(runs);
+    long userUs = 0, sysUs = 0;
+    unsigned long interrupts = smash.getInterruptsCount();
+    //the output of the command would drown the summary, and writing it to a terminal skews the times
+    cout.flush();
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (savedStdout == FAILURE || devNull == FAILURE || dup2(devNull, STDOUT_FILENO) == FAILURE) {
+        if (savedStdout != FAILURE)
+            close(savedStdout);
+        if (devNull != FAILURE)
+            close(devNull);
+        SYS_CALL_ERROR_MESSAGE("dup");
+    }
+    close(devNull);
+    int status = 0;
+    for (long i = 0; i < warmup + runs && status == 0; i++) {
+        CommandTimes times = _timeCommand(cmd_line);
+        status = smash.getLastStatus();
+        //a built-in never waits for events, ctrl-C has to be noticed between the runs
+        smash.handleEvents();
+        if (smash.getInterruptsCount() != interrupts)
+            break;
+        if (i < warmup || status != 0)
+            continue;
+        samples.push_back(times.wallUs);
+        userUs += times.userUs;
+        sysUs += times.sysUs;
+    }
+    cout.flush();
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    if (status != 0) {
+        cerr << "smash error: bench: " << cmd_line << " failed with status " << status << endl;
+        return;
+    }
+    if (samples.empty())
+        return;
+    _printBenchSummary(samples, userUs, sysUs);
+}
+
+static bool _isExecutableFile(const string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+void PathHashTable::validatePathVar() {
+    const char *pathVar = getenv("PATH");
+    if (pathVar == nullptr)
+        pathVar = "";
+    if (cachedPathVar.compare(pathVar) != 0) {
+        table.clear();
+        cachedPathVar = pathVar;
+    }
+}
+
+string PathHashTable::lookup(const string &name) {
+    //names with a slash are never searched in PATH
+    if (name.find('/') != string::npos)
+        return name;
+    validatePathVar();
+    auto entry = table.find(name);
+    if (entry != table.end()) {
+        hitsCount++;
+        entry->second.hits++;
+        return entry->second.path;
+    }
+    missesCount++;
+    size_t start = 0;
+    while (start <= cachedPathVar.size()) {
+        size_t end = cachedPathVar.find(':', start);
+        if (end == string::npos)
+            end = cachedPathVar.size();
+        string dir = cachedPathVar.substr(start, end - start);
+        string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        if (_isExecutableFile(candidate)) {
+            table[name] = HashEntry{candidate, 1};
+            return candidate;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+void PathHashTable::printTable() {
+    //entries found under a PATH that changed since are never listed
+    validatePathVar();
+    if (table.empty()) {
+        cout << "hash: hash table empty" << endl;
     } else {
-        if (_isBackgroundCommand(getCmdLineAsString().c_str())) {
-            SmallShell &smash = SmallShell::getInstance();
-            int jobIdToSet = smash.getJobList()->getJobIdToSet();
-            smash.getJobList()->addJob(this, jobIdToSet, pid, false);
-        } else {
-            SmallShell &smash = SmallShell::getInstance();
-            smash.setForegroundPidFromFather(pid);
-            smash.setJobToForeground(this);
-            if (waitpid(pid, nullptr, WUNTRACED) == FAILURE)
-                SYS_CALL_ERROR_MESSAGE("waitpid");
+        cout << "hits\tcommand" << endl;
+        for (auto &entry: table)
+            cout << entry.second.hits << "\t" << entry.second.path << endl;
+    }
+    cout << "lookups: " << hitsCount + missesCount << " hits: " << hitsCount << " misses: " << missesCount << endl;
+}
+
+void HashCommand::execute() {
+    if (getArgsCount() == 1) {
+        hashTable->printTable();
+        return;
+    }
+    if (string(getArgs()[1]) == "-r") {
+        if (getArgsCount() != 2)
+            PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+        hashTable->clear();
+        return;
+    }
+    if (string(getArgs()[1]) == "-d") {
+        for (int i = 2; i < getArgsCount(); i++)
+            hashTable->forget(getArgs()[i]);
+        return;
+    }
+    for (int i = 1; i < getArgsCount(); i++) {
+        if (hashTable->lookup(getArgs()[i]).empty()) {
+            cerr << "smash error: hash: " << getArgs()[i] << ": not found" << endl;
+            _markCommandFailed();
         }
     }
 }
@@ -311,130 +1620,933 @@ bool isValidNumber(const string &str) {
 }
 
 
-void TailCommand::execute() {
-    if (getArgsCount() > 3 || getArgsCount() <= 1)
-        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
-    int N = 10;
-    string path = string(getArgs()[1]);
-    if (getArgsCount() == 3) {
-        if (path[0] != '-')
-            PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
-        path.erase(0, 1);
-        if (!(isValidNumber(path)))
-            PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
-        N = stoi(path);
-        path = string(getArgs()[2]);
+//the index the last lines lines of data start at, the newline that ends data does not start a line
+static size_t _lastLinesStart(const char *data, size_t size, int lines) {
+    size_t limit = size > 0 && data[size - 1] == '\n' ? size - 1 : size;
+    const char *newline;
+    for (int seen = 0; seen < lines; seen++) {
+        if (limit == 0 || (newline = (const char *) memrchr(data, '\n', limit)) == nullptr)
+            return 0;
+        limit = newline - data;
     }
-    ifstream file;
-    file.open(path, ifstream::in);
-    if (!file) {
-        perror("smash error: open failed");
-        return;
+    return limit + 1;
+}
+
+static bool _preadAll(int fd, char *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t bytes = pread(fd, buffer, size, offset);
+        if (bytes == FAILURE && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return false;
+        buffer += bytes;
+        size -= bytes;
+        offset += bytes;
     }
-    string line;
-    for (int i = 0; i < N && getline(file, line); i++) {
-        cout << line << endl;
+    return true;
+}
+
+/**
+ * The offset the last lines lines of a regular file of size bytes start at, found by reading it
+ * backwards one block at a time, so only the blocks holding those lines are ever read.
+ * *last is set to the last byte of the file. FAILURE on a read error.
+ */
+static off_t _lastLinesOffset(int fd, off_t size, int lines, char *last) {
+    vector<char> block(TAIL_BLOCK_SIZE);
+    off_t end = size;
+    int seen = 0;
+    *last = '\n';
+    while (end > 0 && seen < lines) {
+        size_t length = min(end, (off_t) block.size());
+        off_t start = end - length;
+        if (!_preadAll(fd, block.data(), length, start))
+            return FAILURE;
+        size_t limit = length;
+        if (end == size) {
+            *last = block[length - 1];
+            if (*last == '\n')
+                limit--;
+        }
+        const char *newline;
+        while (limit > 0 && (newline = (const char *) memrchr(block.data(), '\n', limit)) != nullptr) {
+            limit = newline - block.data();
+            if (++seen == lines)
+                return start + limit + 1;
+        }
+        end = start;
+    }
+    return seen == lines ? size : 0;
+}
+
+/**
+ * Copies the last lines lines of inFd to outFd, ending a last unterminated line with a newline. A
+ * regular file is scanned from its end and its lines are moved by the kernel. Anything else, like a
+ * pipe or a /proc file, is read to its end keeping just the lines that may still be printed.
+ */
+static bool _copyLastLines(int inFd, int lines, int outFd) {
+    struct stat st;
+    char last = '\n';
+    if (fstat(inFd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t offset = _lastLinesOffset(inFd, st.st_size, lines, &last);
+        if (offset == FAILURE || transferBytes(inFd, &offset, outFd, st.st_size - offset) == FAILURE)
+            return false;
+        return lines == 0 || last == '\n' || writeAll(outFd, "\n", 1) != FAILURE;
     }
-    file.close();
+    vector<char> data;
+    size_t size = 0;
+    ssize_t bytes;
+    do {
+        if (data.size() - size < TRANSFER_BLOCK_SIZE)
+            data.resize(size + TRANSFER_BLOCK_SIZE);
+        bytes = read(inFd, data.data() + size, TRANSFER_BLOCK_SIZE);
+        if (bytes == FAILURE && errno == EINTR)
+            continue;
+        if (bytes == FAILURE)
+            return false;
+        size += bytes;
+        //everything before the last lines seen so far will never be printed
+        if (size > 4 * TRANSFER_BLOCK_SIZE) {
+            size_t start = _lastLinesStart(data.data(), size, lines);
+            memmove(data.data(), data.data() + start, size - start);
+            size -= start;
+        }
+    } while (bytes != 0);
+    size_t start = _lastLinesStart(data.data(), size, lines);
+    if (lines == 0 || start == size)
+        return true;
+    if (writeAll(outFd, data.data() + start, size - start) == FAILURE)
+        return false;
+    return data[size - 1] == '\n' || writeAll(outFd, "\n", 1) != FAILURE;
+}
 
+struct FollowedFile {
+    string path;
+    //FAILURE while the path never existed
+    int fd;
+    off_t offset;
+    //the inotify watches of the file itself and of its directory, which sees it replaced
+    int watch;
+    int dirWatch;
+    bool isDirty;
+    bool isReplaced;
+};
 
+static void _printTailHeader(const string &path, bool isFirst) {
+    cout << (isFirst ? "" : "\n") << "==> " << path << " <==" << endl;
 }
 
-string string_before_char(string orig, string c) {
-    return _trim(orig.substr(0, orig.find(c)));
+//the last component of path, the name an event of its directory watch carries
+static string _baseName(const string &path) {
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
 }
 
-string string_after_char(string orig, string c) {
-    return _trim(orig.substr(orig.find(c) + c.size()));
+static string _dirName(const string &path) {
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
 }
 
+/**
+ * Prints what was appended to file since it was last read, starting over when it was truncated.
+ * Returns false when the output is gone.
+ */
+static bool _drainFollowedFile(FollowedFile &file, bool withHeader, const FollowedFile *&lastPrinted) {
+    struct stat st;
+    if (file.fd == FAILURE || fstat(file.fd, &st) == FAILURE)
+        return true;
+    if (st.st_size < file.offset) {
+        cerr << "smash: tail: " << file.path << ": file truncated" << endl;
+        file.offset = 0;
+    }
+    if (st.st_size == file.offset)
+        return true;
+    if (withHeader && lastPrinted != &file)
+        _printTailHeader(file.path, false);
+    lastPrinted = &file;
+    cout.flush();
+    return transferBytes(file.fd, &file.offset, STDOUT_FILENO, st.st_size - file.offset) != FAILURE;
+}
 
-void TouchCommand::execute() {
-    if (getArgsCount() != 3)
+//opens the file now found at the path of file, after whatever the old one still had was printed
+static void _reopenFollowedFile(FollowedFile &file, int inotifyFd) {
+    file.isReplaced = false;
+    int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    //until a new file shows up under the path, the old one is still followed wherever it moved
+    if (fd == FAILURE)
+        return;
+    struct stat oldSt, newSt;
+    if (file.fd != FAILURE && fstat(file.fd, &oldSt) == 0 && fstat(fd, &newSt) == 0 &&
+        oldSt.st_ino == newSt.st_ino && oldSt.st_dev == newSt.st_dev) {
+        close(fd);
+        return;
+    }
+    if (file.fd != FAILURE) {
+        close(file.fd);
+        inotify_rm_watch(inotifyFd, file.watch);
+    }
+    file.fd = fd;
+    file.offset = 0;
+    cerr << "smash: tail: " << file.path << " has been replaced, following the new file" << endl;
+    file.watch = inotify_add_watch(inotifyFd, file.path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                                                  IN_DELETE_SELF);
+    file.isDirty = true;
+}
+
+/**
+ * Follows every file until ctrl-C, or until the output goes away. A single inotify fd watches the
+ * files for appends and truncations, and their directories for a file replaced under the same name,
+ * as log rotation does. All events read at once are handled before anything is printed, so a
+ * file written many times since is copied in a single transfer.
+ */
+static void _followFiles(vector<FollowedFile> &files) {
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd == FAILURE) {
+        perror("smash error: inotify_init1 failed");
+        _markCommandFailed();
+        return;
+    }
+    for (FollowedFile &file: files) {
+        file.watch = file.fd == FAILURE ? FAILURE : inotify_add_watch(inotifyFd, file.path.c_str(),
+                                                                      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                                                      IN_DELETE_SELF);
+        file.dirWatch = inotify_add_watch(inotifyFd, _dirName(file.path).c_str(), IN_CREATE | IN_MOVED_TO);
+    }
+    SmallShell &smash = SmallShell::getInstance();
+    unsigned long interrupts = smash.getInterruptsCount();
+    const FollowedFile *lastPrinted = files.size() > 1 ? &files.back() : nullptr;
+    alignas(struct inotify_event) char events[64 * 1024];
+    bool isOutputAlive = true;
+    while (isOutputAlive) {
+        struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {smash.getEventsFd(), POLLIN, 0}};
+        if (poll(fds, 2, -1) == FAILURE && errno != EINTR)
+            break;
+        //tail runs inside smash, so smash itself has to notice the ctrl-C that ends it
+        smash.handleEvents();
+        if (smash.getInterruptsCount() != interrupts)
+            break;
+        ssize_t bytes;
+        while ((bytes = read(inotifyFd, events, sizeof(events))) > 0) {
+            for (char *c = events; c < events + bytes;) {
+                struct inotify_event *event = (struct inotify_event *) c;
+                for (FollowedFile &file: files) {
+                    if (event->wd == file.watch)
+                        file.isReplaced |= (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0;
+                    if (event->wd == file.watch)
+                        file.isDirty = true;
+                    if (event->wd == file.dirWatch && event->len > 0 && _baseName(file.path) == event->name)
+                        file.isReplaced = true;
+                }
+                c += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        for (FollowedFile &file: files) {
+            if (!file.isDirty && !file.isReplaced)
+                continue;
+            file.isDirty = false;
+            isOutputAlive = isOutputAlive && _drainFollowedFile(file, files.size() > 1, lastPrinted);
+            if (file.isReplaced) {
+                _reopenFollowedFile(file, inotifyFd);
+                isOutputAlive = isOutputAlive && _drainFollowedFile(file, files.size() > 1, lastPrinted);
+                file.isDirty = false;
+            }
+        }
+    }
+    close(inotifyFd);
+}
+
+//tail [-N] [-f] file..., -f keeps printing what is appended to the files until ctrl-C
+void TailCommand::execute() {
+    int lines = 10;
+    bool follow = false;
+    vector<string> paths;
+    for (int i = 1; i < getArgsCount(); i++) {
+        string arg = getArgs()[i];
+        if (!paths.empty() || arg.size() < 2 || arg[0] != '-')
+            paths.push_back(arg);
+        else if (arg == "-f")
+            follow = true;
+        else if (isValidNumber(arg.substr(1)) && arg.size() < 11)
+            lines = stoi(arg.substr(1));
+        else
+            PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    }
+    if (paths.empty())
         PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
-    string timeToSet= string(getArgs()[2]);
-    struct tm time;
-    time.tm_sec = stoi(string_before_char(timeToSet, ":"));
-    timeToSet = string_after_char(timeToSet, ":");
-    time.tm_min = stoi(string_before_char(timeToSet,":"));
-    timeToSet = string_after_char(timeToSet, ":");
-    time.tm_hour = stoi(string_before_char(timeToSet,":"))-1;
-    timeToSet = string_after_char(timeToSet, ":");
-    time.tm_mday = stoi(string_before_char(timeToSet,":"));
-    timeToSet = string_after_char(timeToSet, ":");
-    time.tm_mon = stoi(string_before_char(timeToSet,":"))-1;
-    time.tm_year = stoi(string_after_char(timeToSet, ":"))-1900;
-    time_t new_time = mktime(&time);
-    struct utimbuf utimeToSet;
-    utimeToSet.modtime = new_time;
+    vector<FollowedFile> files;
+    for (size_t i = 0; i < paths.size(); i++) {
+        FollowedFile file = {paths[i], open(paths[i].c_str(), O_RDONLY | O_CLOEXEC), 0, FAILURE, FAILURE, false,
+                             false};
+        if (file.fd == FAILURE) {
+            perror("smash error: open failed");
+            _markCommandFailed();
+        } else {
+            if (paths.size() > 1)
+                _printTailHeader(file.path, i == 0);
+            //the lines go straight to the fd, whatever cout still holds has to be written before them
+            cout.flush();
+            struct stat st;
+            if (!_copyLastLines(file.fd, lines, STDOUT_FILENO) || fstat(file.fd, &st) == FAILURE) {
+                perror("smash error: write failed");
+                _markCommandFailed();
+                follow = false;
+            } else
+                file.offset = st.st_size;
+        }
+        files.push_back(file);
+    }
+    if (follow)
+        _followFiles(files);
+    for (FollowedFile &file: files) {
+        if (file.fd != FAILURE)
+            close(file.fd);
+    }
+}
 
-    utimeToSet.actime = new_time;
-    if (utime(getArgs()[1], &utimeToSet) == FAILURE){
-        SYS_CALL_ERROR_MESSAGE("utime");
+/**
+ * Parses the ss:mm:hh:dd:mm:yyyy timestamp of touch in local time. The seconds may carry up to nine
+ * decimal digits, down to nanoseconds. Returns false on a malformed timestamp.
+ */
+static bool _parseTouchTime(const char *text, struct timespec *ts) {
+    long fields[6];
+    long nanoseconds = 0;
+    const char *c = text;
+    for (int i = 0; i < 6; i++) {
+        char *end;
+        if (!isdigit((unsigned char) *c))
+            return false;
+        fields[i] = strtol(c, &end, 10);
+        c = end;
+        if (i == 0 && *c == '.') {
+            long scale = 100000000;
+            for (c++; isdigit((unsigned char) *c) && scale > 0; c++, scale /= 10)
+                nanoseconds += (*c - '0') * scale;
+            if (scale == 100000000 || isdigit((unsigned char) *c))
+                return false;
+        }
+        if (*c != (i < 5 ? ':' : '\0'))
+            return false;
+        c++;
     }
+    //60 is a leap second
+    if (fields[0] > 60 || fields[1] > 59 || fields[2] > 23 || fields[3] < 1 || fields[3] > 31 || fields[4] < 1 ||
+        fields[4] > 12 || fields[5] < 1900 || fields[5] > 9999)
+        return false;
+    struct tm time = {};
+    //a leap second is added afterwards, so it can not move the date compared below
+    time.tm_sec = min(fields[0], 59L);
+    time.tm_min = fields[1];
+    time.tm_hour = fields[2];
+    time.tm_mday = fields[3];
+    time.tm_mon = fields[4] - 1;
+    time.tm_year = fields[5] - 1900;
+    //whether daylight saving time applies is for mktime to find out
+    time.tm_isdst = -1;
+    ts->tv_sec = mktime(&time);
+    ts->tv_nsec = nanoseconds;
+    if (ts->tv_sec == FAILURE)
+        return false;
+    ts->tv_sec += fields[0] - time.tm_sec;
+    //mktime normalizes a day the month does not have, like 31:2, or an hour skipped by daylight saving
+    //time, into another time instead of failing
+    return time.tm_min == fields[1] && time.tm_hour == fields[2] && time.tm_mday == fields[3] &&
+           time.tm_mon == fields[4] - 1 && time.tm_year == fields[5] - 1900;
+}
 
+/**
+ * Sets the times of paths[begin, end). Consecutive paths of the same directory, like the matches of
+ * a glob, are set relative to a single fd of that directory, so it is resolved once and not once per
+ * file. Every path that failed is added to failures with its errno.
+ */
+static void _touchPaths(const vector<string> &paths, size_t begin, size_t end, const struct timespec times[2],
+                        vector<pair<string, int>> &failures) {
+    string dir;
+    int dirFd = FAILURE;
+    for (size_t i = begin; i < end; i++) {
+        const string &path = paths[i];
+        size_t slash = path.find_last_of('/');
+        const char *name = path.c_str();
+        int atFd = AT_FDCWD;
+        if (slash != string::npos && slash + 1 < path.size()) {
+            if (dirFd == FAILURE || path.compare(0, slash + 1, dir) != 0) {
+                if (dirFd != FAILURE)
+                    close(dirFd);
+                dir = path.substr(0, slash + 1);
+                dirFd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            }
+            if (dirFd != FAILURE) {
+                atFd = dirFd;
+                name += slash + 1;
+            }
+        }
+        if (utimensat(atFd, name, times, 0) == FAILURE)
+            failures.emplace_back(path, errno);
+    }
+    if (dirFd != FAILURE)
+        close(dirFd);
+}
+
+//touch path... ss:mm:hh:dd:mm:yyyy
+void TouchCommand::execute() {
+    struct timespec times[2];
+    if (!_parseTouchTime(getArgs()[getArgsCount() - 1], &times[0]))
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    times[1] = times[0];
+    //globs were expanded with the rest of the line
+    vector<string> paths(getArgs() + 1, getArgs() + getArgsCount() - 1);
+    //every worker takes a contiguous slice, so the paths of a directory mostly stay together
+    size_t workersCount = min((size_t) TOUCH_MAX_WORKERS, (paths.size() + TOUCH_PATHS_PER_WORKER - 1) /
+                                                          TOUCH_PATHS_PER_WORKER);
+    workersCount = max(min(workersCount, (size_t) thread::hardware_concurrency()), (size_t) 1);
+    vector<vector<pair<string, int>>> failures(workersCount);
+    vector<thread> workers;
+    size_t slice = (paths.size() + workersCount - 1) / workersCount;
+    for (size_t i = 1; i < workersCount; i++) {
+        workers.emplace_back(_touchPaths, cref(paths), i * slice, min(paths.size(), (i + 1) * slice), times,
+                             ref(failures[i]));
+    }
+    _touchPaths(paths, 0, min(paths.size(), slice), times, failures[0]);
+    for (thread &worker: workers)
+        worker.join();
+    for (auto &workerFailures: failures) {
+        for (auto &failure: workerFailures) {
+            cerr << "smash error: utimensat failed: " << failure.first << ": " << strerror(failure.second) << endl;
+            _markCommandFailed();
+        }
+    }
 }
 
 
 
+/**
+* Splits "cmd > path" / "cmd >> path" into its parts, returns false when there is no redirection.
+*/
+static bool _splitRedirection(const string &cmd_line, string &cmd, string &path, bool &append) {
+    size_t pos = _findUnquoted(cmd_line, '>', 0);
+    if (pos == string::npos)
+        return false;
+    append = cmd_line.compare(pos, 2, ">>") == 0;
+    cmd = _trim(cmd_line.substr(0, pos));
+    path = _trim(cmd_line.substr(pos + (append ? 2 : 1)));
+    return true;
+}
+
+PipeCommand::PipeCommand(const char *cmd_line) : Command(cmd_line) {
+    string line(cmd_line);
+    size_t idx = line.find_last_not_of(WHITESPACE);
+    if (idx != string::npos && line[idx] == '&')
+        line.erase(idx);
+    size_t start = 0, pos;
+    while ((pos = _findUnquoted(line, '|', start)) != string::npos) {
+        stages.push_back(_trim(line.substr(start, pos - start)));
+        bool pipesStderr = line.compare(pos, 2, "|&") == 0;
+        stderrPipes.push_back(pipesStderr);
+        start = pos + (pipesStderr ? 2 : 1);
+    }
+    stages.push_back(_trim(line.substr(start)));
+}
+
+/**
+* Launches a command with stdin/stdout/stderr of smash temporarily replaced by inFd/outFd/errFd
+* (FAILURE keeps smash's own), and returns what its launch returned. A built-in runs inside smash,
+* so commands such as cd or chprompt keep their effect, the processes of any other command inherit
+* the fds.
+*/
+static pid_t _launchWithFds(Command *cmd, int inFd, int outFd, int errFd) {
+    cout.flush();
+    cerr.flush();
+    int savedIn = inFd == FAILURE ? FAILURE : dup(STDIN_FILENO);
+    int savedOut = outFd == FAILURE ? FAILURE : dup(STDOUT_FILENO);
+    int savedErr = errFd == FAILURE ? FAILURE : dup(STDERR_FILENO);
+    if (inFd != FAILURE)
+        dup2(inFd, STDIN_FILENO);
+    if (outFd != FAILURE)
+        dup2(outFd, STDOUT_FILENO);
+    if (errFd != FAILURE)
+        dup2(errFd, STDERR_FILENO);
+    //a reader that went away must fail the write, not kill smash
+    sighandler_t oldPipeHandler = signal(SIGPIPE, SIG_IGN);
+    pid_t pid = cmd->launch();
+    cout.flush();
+    cerr.flush();
+    signal(SIGPIPE, oldPipeHandler);
+    if (savedIn != FAILURE) {
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+    if (savedOut != FAILURE) {
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
+    }
+    if (savedErr != FAILURE) {
+        dup2(savedErr, STDERR_FILENO);
+        close(savedErr);
+    }
+    cout.clear();
+    cerr.clear();
+    return pid;
+}
+
+static int _openRedirection(const string &path, bool append) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+    if (fd == FAILURE) {
+        perror("smash error: open failed");
+        _markCommandFailed();
+    }
+    return fd;
+}
+
 void PipeCommand::execute() {
-    int pipeline[2];
-    if (pipe(pipeline) == FAILURE)
-        SYS_CALL_ERROR_MESSAGE("pipe");
-    string c = getCmdLineAsString().find("|&") == string::npos ? "|" : "|&";
-    string cmd_line1 = string_before_char(getCmdLineAsString(), c);
-    string cmd_line2 = string_after_char(getCmdLineAsString(), c);
+    pid_t pgid = launch();
+    if (pgid != FAILURE)
+        _trackJob(this, pgid);
+}
+
+pid_t PipeCommand::launch() {
+    size_t n = stages.size();
+    //pipe i connects stage i to stage i+1: pipes[2 * i] is its read end, pipes[2 * i + 1] its write end
+    vector<int> pipes(2 * (n - 1), FAILURE);
+    vector<int> redirections(n, FAILURE);
+    vector<Command *> cmds(n, nullptr);
     SmallShell &smash = SmallShell::getInstance();
-    pid_t pid1 = fork();
-    if (pid1 == FAILURE)
-        SYS_CALL_ERROR_MESSAGE("fork");
-    if (pid1 == 0) {
-        setpgrp();
-        setPid();
-        close(c == "|" ? 1 : 2);
-        close(pipeline[0]);
-        dup2(pipeline[1], c == "|" ? 1 : 2);
-        smash.executeCommand(cmd_line1.c_str());
-        close(pipeline[1]);
-        exit(0);
-    }
-    pid_t pid2 = fork();
-    if (pid2 == FAILURE)
-        SYS_CALL_ERROR_MESSAGE("fork");
-    if (pid2 == 0) {
-        setpgrp();
-        setPid();
-        close(c == "|" ? 0 : 2);
-        close(pipeline[1]);
-        dup2(pipeline[0], c == "|" ? 0 : 2);
-        close(pipeline[0]);
-        smash.executeCommand(cmd_line2.c_str());
-        exit(0);
-    }
-    close(pipeline[0]);
-    close(pipeline[1]);
-    wait(nullptr);
-    wait(nullptr);
+    bool isValid = true;
+    for (size_t i = 0; isValid && i + 1 < n; i++) {
+        if (pipe2(&pipes[2 * i], O_CLOEXEC) == FAILURE) {
+            perror("smash error: pipe failed");
+            _markCommandFailed();
+            isValid = false;
+        }
+    }
+    for (size_t i = 0; isValid && i < n; i++) {
+        string cmd_line = stages[i], path;
+        bool append = false;
+        if (_splitRedirection(stages[i], cmd_line, path, append)) {
+            redirections[i] = _openRedirection(path, append);
+            isValid = redirections[i] != FAILURE;
+        }
+        if (isValid && cmd_line.empty()) {
+            cerr << "smash error: invalid null command" << endl;
+            _markCommandFailed();
+            isValid = false;
+        }
+        if (isValid)
+            cmds[i] = smash.CreateCommand(cmd_line.c_str());
+        if (isValid && dynamic_cast<BuiltInCommand *>(cmds[i]) == nullptr &&
+            dynamic_cast<ExternalCommand *>(cmds[i]) == nullptr) {
+            cerr << "smash error: " << cmds[i]->getName() << ": can not run as a pipe stage" << endl;
+            _markCommandFailed();
+            isValid = false;
+        }
+    }
+    pid_t pgid = 0;
+    //external stages start first, so every built-in stage already has its reader running
+    for (size_t i = 0; isValid && i < 2 * n; i++) {
+        size_t stage = i % n;
+        bool isBuiltin = dynamic_cast<BuiltInCommand *>(cmds[stage]) != nullptr;
+        if (isBuiltin != (i >= n))
+            continue;
+        int pipeOut = stage + 1 < n ? pipes[2 * stage + 1] : FAILURE;
+        bool pipesStderr = stage + 1 < n && stderrPipes[stage];
+        int outFd = redirections[stage] != FAILURE ? redirections[stage] : (pipesStderr ? FAILURE : pipeOut);
+        int errFd = pipesStderr ? pipeOut : FAILURE;
+        if (isBuiltin) {
+            int inFd = stage > 0 ? pipes[2 * (stage - 1)] : FAILURE;
+            //a built-in that does not read its input lets the writer see the pipe closed
+            if (inFd != FAILURE && !dynamic_cast<BuiltInCommand *>(cmds[stage])->readsInput()) {
+                close(inFd);
+                pipes[2 * (stage - 1)] = FAILURE;
+                inFd = FAILURE;
+            }
+            _launchWithFds(cmds[stage], inFd, outFd, errFd);
+            if (pipeOut != FAILURE) {
+                close(pipeOut);
+                pipes[2 * stage + 1] = FAILURE;
+            }
+        } else {
+            int inFd = stage > 0 ? pipes[2 * (stage - 1)] : FAILURE;
+            pid_t pid = dynamic_cast<ExternalCommand *>(cmds[stage])->spawn(pgid, inFd, outFd, errFd);
+            if (pid != FAILURE && pgid == 0)
+                pgid = pid;
+            //the stage holds its own write end now, a built-in reading the pipe has to see it close
+            if (pipeOut != FAILURE) {
+                close(pipeOut);
+                pipes[2 * stage + 1] = FAILURE;
+            }
+            //and its own read end, a built-in writing the pipe has to see the reader go away
+            if (inFd != FAILURE) {
+                close(inFd);
+                pipes[2 * (stage - 1)] = FAILURE;
+            }
+        }
+    }
+    _closeFds(pipes);
+    _closeFds(redirections);
+    for (Command *cmd: cmds)
+        delete cmd;
+    return pgid != 0 ? pgid : FAILURE;
+}
+
+FanOutCommand::FanOutCommand(const char *cmd_line) : Command(cmd_line), isValid(false) {
+    string line(cmd_line);
+    size_t idx = line.find_last_not_of(WHITESPACE);
+    if (idx != string::npos && line[idx] == '&')
+        line.erase(idx);
+    size_t pos = _findUnquoted(line, '|', 0);
+    if (pos == string::npos || line.compare(pos, 2, "|>") != 0)
+        return;
+    producer = _trim(line.substr(0, pos));
+    string list = _trim(line.substr(pos + 2));
+    if (list.size() < 2 || list.front() != '(' || list.back() != ')')
+        return;
+    list = list.substr(1, list.size() - 2);
+    size_t start = 0, comma;
+    while ((comma = _findUnquoted(list, ',', start)) != string::npos) {
+        consumers.push_back(_trim(list.substr(start, comma - start)));
+        start = comma + 1;
+    }
+    consumers.push_back(_trim(list.substr(start)));
+    isValid = !producer.empty() && find(consumers.begin(), consumers.end(), "") == consumers.end();
+}
+
+/**
+ * Forks the distributor of a fan-out into process group pgid. It keeps only the read end of the
+ * producer's pipe and the write ends of the consumers' pipes: any other pipe end it held on to would
+ * keep a job from ever seeing the other side of its pipe close.
+ */
+//the fan-out helper installed next to the binary smash runs from
+static const string &_fanOutHelperPath() {
+    static string path;
+    if (path.empty()) {
+        char exe[PATH_MAX];
+        ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        string binary = length > 0 ? string(exe, length) : "";
+        path = binary.substr(0, binary.rfind('/') + 1) + FANOUT_HELPER_NAME;
+    }
+    return path;
+}
+
+//launches the distributor of a fan-out into process group pgid, reading inFd and writing every fd of outFds
+static pid_t _spawnFanOut(pid_t pgid, int inFd, const vector<int> &outFds) {
+    char name[] = FANOUT_HELPER_NAME;
+    string count = to_string(outFds.size());
+    char *argv[] = {name, &count[0], nullptr};
+    return _spawnProcess(_fanOutHelperPath().c_str(), argv, pgid, inFd, FAILURE, FAILURE, outFds);
+}
+
+void FanOutCommand::execute() {
+    pid_t pgid = launch();
+    if (pgid != FAILURE)
+        _trackJob(this, pgid);
+}
+
+pid_t FanOutCommand::launch() {
+    if (!isValid) {
+        cerr << "smash error: fan-out: invalid arguments" << endl;
+        _markCommandFailed();
+        return FAILURE;
+    }
+    //stage 0 is the producer and stage i its i-th consumer, pipe i goes into stage i: pipes[2 * i]
+    //is its read end and pipes[2 * i + 1] its write end. Pipe 0 is read by the distributor.
+    size_t n = consumers.size() + 1;
+    vector<int> pipes(2 * n, FAILURE);
+    vector<int> redirections(n, FAILURE);
+    vector<Command *> cmds(n, nullptr);
+    SmallShell &smash = SmallShell::getInstance();
+    bool isValid = true;
+    for (size_t i = 0; isValid && i < n; i++) {
+        if (pipe2(&pipes[2 * i], O_CLOEXEC) == FAILURE) {
+            perror("smash error: pipe failed");
+            _markCommandFailed();
+            isValid = false;
+        }
+    }
+    for (size_t i = 0; isValid && i < n; i++) {
+        const string &stage = i == 0 ? producer : consumers[i - 1];
+        string cmd_line = stage, path;
+        bool append = false;
+        if (_splitRedirection(stage, cmd_line, path, append)) {
+            redirections[i] = _openRedirection(path, append);
+            isValid = redirections[i] != FAILURE;
+        }
+        if (isValid && cmd_line.empty()) {
+            cerr << "smash error: invalid null command" << endl;
+            _markCommandFailed();
+            isValid = false;
+        }
+        if (isValid)
+            cmds[i] = smash.CreateCommand(cmd_line.c_str());
+        //only the producer may be a built-in, built-ins never read their input
+        if (isValid && dynamic_cast<ExternalCommand *>(cmds[i]) == nullptr &&
+            (i > 0 || dynamic_cast<BuiltInCommand *>(cmds[i]) == nullptr)) {
+            cerr << "smash error: " << cmds[i]->getName() << ": can not run as a fan-out "
+                 << (i == 0 ? "producer" : "consumer") << endl;
+            _markCommandFailed();
+            isValid = false;
+        }
+    }
+    pid_t pgid = 0;
+    //the consumers and the distributor start first, so the producer's output has somewhere to go
+    for (size_t i = 1; isValid && i < n; i++) {
+        pid_t pid = dynamic_cast<ExternalCommand *>(cmds[i])->spawn(pgid, pipes[2 * i], redirections[i], FAILURE);
+        if (pid != FAILURE && pgid == 0)
+            pgid = pid;
+    }
+    vector<int> consumerFds;
+    for (size_t i = 1; i < n; i++)
+        consumerFds.push_back(pipes[2 * i + 1]);
+    if (pgid != 0 && _spawnFanOut(pgid, pipes[0], consumerFds) == FAILURE) {
+        perror("smash error: fan-out failed");
+        _markCommandFailed();
+    }
+    //only the distributor reads the producer, and only the distributor writes to the consumers
+    for (size_t i = 0; i < n; i++) {
+        int &fd = pipes[i == 0 ? 0 : 2 * i + 1];
+        if (fd != FAILURE)
+            close(fd);
+        fd = FAILURE;
+    }
+    int outFd = redirections[0] != FAILURE ? redirections[0] : pipes[1];
+    if (pgid != 0 && dynamic_cast<BuiltInCommand *>(cmds[0]) != nullptr)
+        _launchWithFds(cmds[0], FAILURE, outFd, FAILURE);
+    else if (pgid != 0)
+        dynamic_cast<ExternalCommand *>(cmds[0])->spawn(pgid, FAILURE, outFd, FAILURE);
+    _closeFds(pipes);
+    _closeFds(redirections);
+    for (Command *cmd: cmds)
+        delete cmd;
+    return pgid != 0 ? pgid : FAILURE;
 }
 
 void RedirectionCommand::execute() {
-    string c = getCmdLineAsString().find(">>") == string::npos ? ">" : ">>";
-    string cmd = string_before_char(getCmdLineAsString(), c);
-    string path = string_after_char(getCmdLineAsString(), c);
-    pid_t pid = fork();
-    if (pid == FAILURE)
-        SYS_CALL_ERROR_MESSAGE("fork");
-    if (pid == 0) {
-        setpgrp();
-        setPid();
-        int new_fd = open(path.c_str(), O_WRONLY | O_CREAT | (c == ">" ? O_TRUNC : O_APPEND), 0777);
-        if (new_fd == FAILURE)
-            SYS_CALL_ERROR_MESSAGE("open");
-        close(1);
-        dup2(new_fd, 1);
-        SmallShell &smash = SmallShell::getInstance();
-        smash.executeCommand(cmd.c_str());
-        close(new_fd);
-        exit(0);
+    pid_t pid = launch();
+    if (pid != FAILURE)
+        _trackJob(this, pid);
+}
+
+pid_t RedirectionCommand::launch() {
+    char *line = new char[strlen(getCmdLine()) + 1];
+    strcpy(line, getCmdLine());
+    _removeBackgroundSign(line);
+    string cmd_line, path;
+    bool append = false;
+    _splitRedirection(line, cmd_line, path, append);
+    delete[] line;
+    if (cmd_line.empty()) {
+        cerr << "smash error: invalid null command" << endl;
+        _markCommandFailed();
+        return FAILURE;
+    }
+    int fd = _openRedirection(path, append);
+    if (fd == FAILURE)
+        return FAILURE;
+    Command *cmd = SmallShell::getInstance().CreateCommand(cmd_line.c_str());
+    ExternalCommand *external = dynamic_cast<ExternalCommand *>(cmd);
+    pid_t pid = FAILURE;
+    if (external != nullptr)
+        pid = external->spawn(0, FAILURE, fd, FAILURE);
+    else
+        _launchWithFds(cmd, FAILURE, fd, FAILURE);
+    close(fd);
+    delete cmd;
+    return pid;
+}
+
+//word as a single word of a command line, quoted only when it has to be
+static string _quoteWord(const string &word) {
+    if (!word.empty() && word.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                                "0123456789_./:=+,@%-") == string::npos)
+        return word;
+    string quoted = "'";
+    for (char c: word)
+        quoted += c == '\'' ? string("'\\''") : string(1, c);
+    return quoted + "'";
+}
+
+void ParallelCommand::startJob(const string &arg, int inFd) {
+    SmallShell &smash = SmallShell::getInstance();
+    string quoted = _quoteWord(arg), cmd_line = cmdTemplate;
+    size_t pos = cmd_line.find("{}");
+    if (pos == string::npos)
+        cmd_line += " " + quoted;
+    for (; pos != string::npos; pos = cmd_line.find("{}", pos + quoted.size()))
+        cmd_line.replace(pos, 2, quoted);
+    ParallelJob job = {cmd_line, 0, FAILURE, FAILURE};
+    if (isGrouped) {
+        job.outFd = memfd_create("parallel-stdout", MFD_CLOEXEC);
+        job.errFd = memfd_create("parallel-stderr", MFD_CLOEXEC);
+    }
+    launched.push_back(job);
+    Command *cmd = smash.CreateCommand(cmd_line.c_str());
+    smash.setLastStatus(0);
+    pid_t pgid = _launchWithFds(cmd, inFd, job.outFd, job.errFd);
+    delete cmd;
+    if (pgid != FAILURE) {
+        running[pgid] = launched.size() - 1;
+        return;
+    }
+    //a built-in that already ran, or a job that could not start
+    launched.back().status = smash.getLastStatus();
+    finishJob(launched.size() - 1);
+}
+
+void ParallelCommand::finishJob(size_t index) {
+    ParallelJob &job = launched[index];
+    if (job.status != 0)
+        failedCount++;
+    cout.flush();
+    cerr.flush();
+    int outputs[2][2] = {{job.outFd, STDOUT_FILENO}, {job.errFd, STDERR_FILENO}};
+    for (auto &output: outputs) {
+        if (output[0] == FAILURE)
+            continue;
+        struct stat st;
+        off_t offset = 0;
+        if (fstat(output[0], &st) == 0 && st.st_size > 0)
+            transferBytes(output[0], &offset, output[1], st.st_size);
+        close(output[0]);
+    }
+    job.outFd = FAILURE;
+    job.errFd = FAILURE;
+}
+
+void ParallelCommand::onProcessExit(pid_t pgid, int status, bool isLast) {
+    auto job = running.find(pgid);
+    if (job == running.end())
+        return;
+    ParallelJob &parallelJob = launched[job->second];
+    //a job fails when any of its processes fails, like a foreground line
+    if (parallelJob.status == 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+        parallelJob.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (!isLast)
+        return;
+    size_t index = job->second;
+    running.erase(job);
+    finishJob(index);
+}
+
+//the position of the first unquoted ::: word of line, string::npos when there is none
+static size_t _findArgsSeparator(const string &line) {
+    for (size_t pos = _findUnquoted(line, ':', 0); pos != string::npos; pos = _findUnquoted(line, ':', pos + 1)) {
+        size_t end = pos + 3;
+        if ((pos == 0 || _isWhitespace(line[pos - 1])) && line.compare(pos, 3, ":::") == 0 &&
+            (end == line.size() || _isWhitespace(line[end])))
+            return pos;
+    }
+    return string::npos;
+}
+
+void ParallelCommand::execute() {
+    SmallShell &smash = SmallShell::getInstance();
+    if (smash.getProcessGroupObserver() != nullptr)
+        PRINT_SMASH_ERROR_AND_RETURN("can not run inside another parallel");
+    long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int word = 1;
+    for (; word < getArgsCount(); word++) {
+        if (strcmp(getArgs()[word], "-g") == 0)
+            isGrouped = true;
+        else if (strcmp(getArgs()[word], "-j") == 0) {
+            if (word + 1 == getArgsCount() || !_isInt(getArgs()[word + 1]))
+                PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+            maxJobs = stol(getArgs()[++word]);
+        } else
+            break;
+    }
+    //the template is kept as typed, its quotes and globs are for every job to parse
+    string rest = _skipWords(getCmdLine(), word);
+    size_t separator = _findArgsSeparator(rest);
+    bool hasArgsList = separator != string::npos;
+    cmdTemplate = _trim(rest.substr(0, separator));
+    vector<string> args;
+    if (hasArgsList) {
+        CommandArena arena;
+        ArgsVector words;
+        _parseCommandLine(rest.c_str() + separator + 3, arena, words);
+        for (size_t i = 0; i < words.size(); i++)
+            args.emplace_back(words.data()[i]);
+    } else if (!cmdTemplate.empty() && cmdTemplate.back() == '&') {
+        cmdTemplate = _trim(cmdTemplate.substr(0, cmdTemplate.size() - 1));
+    }
+    //a single quoted word is the whole command, like parallel "cmd1 {}; cmd2 {}"
+    CommandArena arena;
+    ArgsVector templateWords;
+    _parseCommandLine(cmdTemplate.c_str(), arena, templateWords);
+    if (templateWords.size() == 1)
+        cmdTemplate = templateWords.data()[0];
+    if (maxJobs <= 0 || cmdTemplate.empty())
+        PRINT_SMASH_ERROR_AND_RETURN("invalid arguments");
+    //jobs must not eat the lines that are their args
+    LineReader *input = nullptr;
+    bool ownsInput = false;
+    if (!hasArgsList) {
+        //stdin is what smash runs: the lines it already read ahead are the first args
+        LineReader *shellInput = smash.getInputReader();
+        if (shellInput != nullptr && shellInput->readsFileOf(STDIN_FILENO)) {
+            input = shellInput;
+        } else {
+            input = new LineReader(STDIN_FILENO, STDIN_BLOCK_SIZE);
+            ownsInput = true;
+        }
+    }
+    int jobsInFd = input != nullptr ? open("/dev/null", O_RDONLY | O_CLOEXEC) : FAILURE;
+    smash.setProcessGroupObserver(this);
+    unsigned long interrupts = smash.getInterruptsCount();
+    bool isInterrupted = false;
+    long long startNs = _monotonicNs();
+    size_t nextArg = 0;
+    string line;
+    while (true) {
+        while (!isInterrupted && (long) running.size() < maxJobs) {
+            if (nextArg < args.size())
+                startJob(args[nextArg++], jobsInFd);
+            else if (input != nullptr && input->nextLine(line)) {
+                if (!line.empty())
+                    startJob(line, jobsInFd);
+            } else
+                break;
+        }
+        //the input is only read while there is room for another job
+        bool readsInput = input != nullptr && !isInterrupted && (long) running.size() < maxJobs;
+        if (running.empty() && !readsInput)
+            break;
+        struct pollfd fds[2] = {{smash.getEventsFd(), POLLIN, 0}, {readsInput ? input->getFd() : FAILURE, POLLIN, 0}};
+        if (poll(fds, 2, -1) == FAILURE && errno != EINTR) {
+            perror("smash error: poll failed");
+            break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t bytes = input->fill();
+            if (bytes == FAILURE && errno != EINTR)
+                perror("smash error: read failed");
+            if (bytes <= 0 && !(bytes == FAILURE && errno == EINTR)) {
+                if (input->lastLine(line))
+                    args.push_back(line);
+                if (ownsInput)
+                    delete input;
+                input = nullptr;
+            }
+        }
+        if (fds[0].revents & POLLIN)
+            smash.handleEvents();
+        if (!isInterrupted && smash.getInterruptsCount() != interrupts) {
+            //ctrl-C or ctrl-Z: no new job starts, and the running ones are killed
+            isInterrupted = true;
+            for (auto &job: running) {
+                if (smash.getJobList()->isGroupAlive(job.first) && killpg(job.first, SIGKILL) == FAILURE)
+                    perror("smash error: kill failed");
+            }
+        }
     }
+    double elapsedUs = (_monotonicNs() - startNs) / 1e3;
+    smash.setProcessGroupObserver(nullptr);
+    if (ownsInput)
+        delete input;
+    if (jobsInFd != FAILURE)
+        close(jobsInFd);
+    cout.flush();
+    for (size_t i = 0; i < launched.size(); i++)
+        cerr << "[" << i + 1 << "] " << launched[i].cmd_line << " : " << launched[i].status << endl;
+    cerr << "parallel: " << launched.size() << " jobs, " << failedCount << " failed, in " << _duration(elapsedUs)
+         << ", " << (elapsedUs > 0 ? launched.size() / (elapsedUs / 1e6) : 0) << " jobs/s" << endl;
+    smash.setLastStatus(0);
+    if (failedCount > 0 || isInterrupted)
+        _markCommandFailed();
 }
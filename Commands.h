@@ -2,51 +2,242 @@
 #define SMASH_COMMAND_H_
 
 #include <vector>
+#include <unordered_map>
+#include <map>
+#include <queue>
+#include <set>
 #include <algorithm>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <cassert>
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <utime.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include "smash_plugin.h"
+#include "stats.h"
+#include "globbing.h"
 
 using namespace std;
-#define COMMAND_ARGS_MAX_LENGTH (200)
-#define COMMAND_MAX_ARGS (20)
+//commands up to these sizes are stored inside the Command itself, longer ones grow on the heap
+#define COMMAND_INLINE_LENGTH (200)
+#define COMMAND_INLINE_ARGS (20)
+#define COMMAND_ARENA_INLINE_SIZE (2 * (COMMAND_INLINE_LENGTH + 1))
+//the words a glob expands to are packed in heap blocks of at least this size
+#define COMMAND_ARENA_OVERFLOW_SIZE (1 << 16)
+#define STDIN_BLOCK_SIZE (4096)
+#define SCRIPT_BLOCK_SIZE (1 << 16)
+//tail reads a file backwards this much at a time, a few lines rarely need more than the first block
+#define TAIL_BLOCK_SIZE (1 << 16)
+//touch spreads large batches of paths over a few threads, every one with at least this many paths
+#define TOUCH_PATHS_PER_WORKER (4096)
+#define TOUCH_MAX_WORKERS (8)
+
+//marks the command line being executed as failed, for set -e
+void _markCommandFailed();
+
 #define PRINT_SMASH_ERROR_AND_RETURN(message)  do { \
     cerr << "smash error: " << getName() << ": " << (message) << endl; \
     std::cerr.flush();\
+    _markCommandFailed();\
     return;} while(0)
 
 #define SYS_CALL_ERROR_MESSAGE(name) do{\
     string ret =  "smash error: " + string(name) + " failed" ; \
     perror(ret.c_str());     \
+    _markCommandFailed();\
    return;} while(0)
 
 #define FAILURE -1
 
-int _parseCommandLine(const char *cmd_line, char **args);
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+//FAILURE with errno ENOSYS on kernels without pidfd support
+int _pidfdOpen(pid_t pid);
+
+int _pidfdSendSignal(int pidfd, int sig, unsigned int flags);
+
+//waitid that also reports the resource usage of the reaped child, like wait4 does
+int _waitidUsage(idtype_t idType, id_t id, siginfo_t *info, int options, struct rusage *usage);
+
+/**
+ * Resources used by the processes of a job: the reaped ones as reported by wait4, plus the live
+ * ones sampled from /proc. Block I/O is counted in bytes, as /proc/<pid>/io does.
+ */
+struct ResourceUsage {
+    long userUs;
+    long sysUs;
+    long maxRssKb;
+    long voluntarySwitches;
+    long involuntarySwitches;
+    long readBytes;
+    long writeBytes;
+
+    ResourceUsage() : userUs(0), sysUs(0), maxRssKb(0), voluntarySwitches(0), involuntarySwitches(0),
+                      readBytes(0), writeBytes(0) {}
+
+    void add(const struct rusage &usage);
+
+    //peaks are not additive, the peak of a job is the largest peak of its processes
+    void add(const ResourceUsage &other);
+
+    //adds the usage of the live process pid so far, false when /proc has no such process
+    bool sample(pid_t pid);
+};
+
+/**
+ * Bump allocator holding the text of a single command line. A line that fits the inline block
+ * never touches the heap, a longer one takes exactly one heap block. The words a glob expands to
+ * do not fit in what the line itself needs, they go to overflow blocks.
+ */
+class CommandArena {
+    char inlineBlock[COMMAND_ARENA_INLINE_SIZE];
+    char *block;
+    size_t capacity;
+    size_t used;
+    std::vector<char *> overflowBlocks;
+    size_t overflowCapacity;
+    size_t overflowUsed;
+
+    void freeOverflow() {
+        for (char *overflow: overflowBlocks)
+            delete[] overflow;
+        overflowBlocks.clear();
+        overflowCapacity = 0;
+        overflowUsed = 0;
+    }
+
+public:
+    CommandArena() : block(inlineBlock), capacity(sizeof(inlineBlock)), used(0), overflowCapacity(0),
+                     overflowUsed(0) {}
+
+    ~CommandArena() {
+        if (block != inlineBlock)
+            delete[] block;
+        freeOverflow();
+    }
+
+    CommandArena(CommandArena const &) = delete;
+
+    void operator=(CommandArena const &) = delete;
+
+    //drops everything allocated so far and makes sure size bytes are available
+    void reset(size_t size) {
+        used = 0;
+        freeOverflow();
+        if (size <= capacity)
+            return;
+        if (block != inlineBlock)
+            delete[] block;
+        block = new char[size];
+        capacity = size;
+    }
+
+    char *allocate(size_t size) {
+        if (used + size > capacity) {
+            if (overflowUsed + size > overflowCapacity) {
+                overflowCapacity = std::max(size, (size_t) COMMAND_ARENA_OVERFLOW_SIZE);
+                overflowUsed = 0;
+                overflowBlocks.push_back(new char[overflowCapacity]);
+            }
+            char *ret = overflowBlocks.back() + overflowUsed;
+            overflowUsed += size;
+            return ret;
+        }
+        char *ret = block + used;
+        used += size;
+        return ret;
+    }
+};
+
+/**
+ * NULL terminated argument vector. The first COMMAND_INLINE_ARGS arguments are kept inline, a longer
+ * command moves them to the heap and keeps doubling, so the only limit left is the ARG_MAX of exec.
+ */
+class ArgsVector {
+    char *inlineArgs[COMMAND_INLINE_ARGS + 1];
+    char **args;
+    size_t count;
+    size_t capacity;
+public:
+    ArgsVector() : args(inlineArgs), count(0), capacity(COMMAND_INLINE_ARGS) {
+        args[0] = nullptr;
+    }
+
+    ~ArgsVector() {
+        if (args != inlineArgs)
+            delete[] args;
+    }
+
+    ArgsVector(ArgsVector const &) = delete;
+
+    void operator=(ArgsVector const &) = delete;
+
+    void push_back(char *arg) {
+        if (count == capacity) {
+            char **grown = new char *[2 * capacity + 1];
+            memcpy(grown, args, count * sizeof(char *));
+            if (args != inlineArgs)
+                delete[] args;
+            args = grown;
+            capacity *= 2;
+        }
+        args[count++] = arg;
+        args[count] = nullptr;
+    }
+
+    char **data() {
+        return args;
+    }
+
+    size_t size() const {
+        return count;
+    }
+};
+
+int _parseCommandLine(const char *cmd_line, CommandArena &arena, ArgsVector &args);
+
+bool _isBackgroundCommand(const char *cmd_line);
+
+void _removeBackgroundSign(char *cmd_line);
+
+bool _isSimpleCommandLine(const char *cmd_line);
 
 class Command {
     string name;
-    char **args;
+    //the cmd line and every argument live in the arena, args points into it
+    CommandArena arena;
+    ArgsVector args;
     int argsCount;
     char *cmd_line;
     pid_t pid;
 public:
-    Command(const char *cmd_line) {
-        args = new char *[COMMAND_MAX_ARGS];
-        argsCount = _parseCommandLine(cmd_line, args);
-        name = string(args[0]);
-        cmd_line = cmd_line;
+    Command(const char *cmd_line) : pid(FAILURE) {
+        size_t size = strlen(cmd_line) + 1;
+        arena.reset(2 * size);
+        this->cmd_line = arena.allocate(size);
+        memcpy(this->cmd_line, cmd_line, size);
+        //the args never contain the background sign, the cmd line keeps it for printing
+        StatsScope parse(STATS_PARSE);
+        argsCount = _parseCommandLine(cmd_line, arena, args);
+        name = argsCount > 0 ? args.data()[0] : "";
     }
 
-    virtual ~Command() {
-        for (int i = 0; i < argsCount; i++)
-            free(args[i]);
-        delete[] args;
-        delete cmd_line;
-    }
+    virtual ~Command() = default;
 
     void setPid(pid_t _pid = getpid()) {
         pid = _pid;
@@ -58,11 +249,20 @@ public:
 
     virtual void execute() = 0;
 
+    /**
+     * Starts the command without waiting for it and returns the process group it runs in.
+     * A command that runs inside smash is done once this returns, and returns FAILURE.
+     */
+    virtual pid_t launch() {
+        execute();
+        return FAILURE;
+    }
+
     //todo virtual void prepare();
     //todo virtual void cleanup();
     // TODO: Add your extra methods if needed
     char **getArgs() {
-        return args;
+        return args.data();
     }
 
     string getCmdLineAsString() const {
@@ -89,6 +289,11 @@ public:
     BuiltInCommand(const char *cmd_line): Command(cmd_line){}
 
     virtual ~BuiltInCommand() = default;
+
+    //true for a built-in that reads its stdin, the pipe feeding it as a pipe stage stays open for it
+    virtual bool readsInput() const {
+        return false;
+    }
 };
 
 class ExternalCommand : public Command {
@@ -100,15 +305,46 @@ public:
 
     void execute() override;
 
+    pid_t launch() override {
+        return spawn();
+    }
+
+    //launches the command into process group pgid (0 for a new group) with the given stdio fds
+    //(FAILURE keeps smash's own) without waiting for it
+    pid_t spawn(pid_t pgid = 0, int inFd = FAILURE, int outFd = FAILURE, int errFd = FAILURE);
 };
 
 class PipeCommand : public Command {
+    //the command line of every stage, stderrPipes[i] is true when stage i feeds stage i+1 with "|&"
+    vector<string> stages;
+    vector<bool> stderrPipes;
 public:
-    PipeCommand(const char *cmd_line): Command(cmd_line){}
+    PipeCommand(const char *cmd_line);
 
     virtual ~PipeCommand() {}
 
     void execute() override;
+
+    pid_t launch() override;
+};
+
+/**
+ * producer |> (consumer, consumer, ...): every consumer reads the whole output of a single producer.
+ * A distributor process forked by smash duplicates the stream with tee(2), and shares the process
+ * group of the producer and the consumers, so the whole fan-out is one job.
+ */
+class FanOutCommand : public Command {
+    string producer;
+    vector<string> consumers;
+    bool isValid;
+public:
+    FanOutCommand(const char *cmd_line);
+
+    virtual ~FanOutCommand() {}
+
+    void execute() override;
+
+    pid_t launch() override;
 };
 
 class RedirectionCommand : public Command {
@@ -119,6 +355,8 @@ public:
     virtual ~RedirectionCommand() {}
 
     void execute() override;
+
+    pid_t launch() override;
     //void prepare() override;
     //void cleanup() override;
 };
@@ -161,6 +399,35 @@ public:
     void execute() override;
 };
 
+//stands in for a built-in whose arguments do not match its schema, and reports them when executed
+class InvalidArgumentsCommand : public BuiltInCommand {
+public:
+    InvalidArgumentsCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~InvalidArgumentsCommand() {}
+
+    void execute() override;
+};
+
+class SetCommand : public BuiltInCommand {
+public:
+    SetCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~SetCommand() {}
+
+    void execute() override;
+};
+
+//export NAME=VALUE..., seen by smash's own PATH lookups and by everything it launches from then on
+class ExportCommand : public BuiltInCommand {
+public:
+    ExportCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~ExportCommand() {}
+
+    void execute() override;
+};
+
 class JobsList;
 
 class QuitCommand : public BuiltInCommand {
@@ -176,148 +443,330 @@ public:
 class JobsList {
 public:
     class JobEntry;
+
+    //a job submitted by after, it has a job id but no process until every job it waits on succeeded
+    struct PendingJob {
+        string cmdLine;
+        set<int> waitingOn;
+    };
 private:
-    vector<JobEntry *> list;
-    int currJobId;
+    //every job is in all indexes: hashed by job id and by process group id, and ordered by job id
+    unordered_map<int, JobEntry *> jobsById;
+    unordered_map<pid_t, JobEntry *> jobsByPid;
+    map<int, JobEntry *> orderedJobs;
+    set<int> stoppedJobIds;
+    //every live child of smash with its process group, and how many processes every group has left
+    unordered_map<pid_t, pid_t> processGroups;
+    unordered_map<pid_t, int> groupSizes;
+    //what the reaped processes of every live process group used
+    unordered_map<pid_t, ResourceUsage> groupUsages;
+    //pending jobs by job id, and the pending jobs waiting on every job id
+    map<int, PendingJob> pendingJobs;
+    unordered_map<int, vector<int>> dependents;
+    //the pidfd of every job is watched here, with the job's process group id as the event data
+    int epollFd;
 public:
-    JobsList() : currJobId(1) {}
+    JobsList() : epollFd(FAILURE) {}
+
+    ~JobsList() {
+        for (auto &job: orderedJobs) {
+            delete job.second->getCommand();
+            delete job.second;
+        }
+    }
+
+    void setEpollFd(int fd) {
+        epollFd = fd;
+    }
+
+    bool empty() {
+        return orderedJobs.empty();
+    }
 
-    ~JobsList() = default;
+    int size() {
+        return orderedJobs.size();
+    }
 
+    //the list owns cmd from now on, and deletes it together with the job
     void addJob(Command *cmd, int jobId, pid_t pid, bool isStopped = false) {
         JobEntry *job = new JobEntry(pid, jobId, cmd, isStopped, time(nullptr));
-        list.push_back(job);
+        if (job->getPidfd() != FAILURE && epollFd != FAILURE) {
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = pid;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, job->getPidfd(), &event);
+        }
+        jobsById[jobId] = job;
+        jobsByPid[pid] = job;
+        orderedJobs[jobId] = job;
+        if (isStopped)
+            stoppedJobIds.insert(jobId);
     }
 
     int getJobIdToSet() {
-        if(list.empty())
-            return 1;
-        currJobId = (*list.begin())->getJobId();
-        for (auto job: list) {
-            if(currJobId<job->getJobId())
-                currJobId=job->getJobId();
-        }
-        return currJobId++;
+        int maxJobId = orderedJobs.empty() ? 0 : orderedJobs.rbegin()->first;
+        if (!pendingJobs.empty())
+            maxJobId = max(maxJobId, pendingJobs.rbegin()->first);
+        return maxJobId + 1;
     }
 
+    //the pending jobs are listed among the others, with the job ids they wait on instead of a pid
     void printJobsList() {
-        std::sort(list.begin(), list.end());
-        for (auto job: list) {
+        auto pending = pendingJobs.begin();
+        for (auto &entry: orderedJobs) {
+            for (; pending != pendingJobs.end() && pending->first < entry.first; ++pending)
+                printPendingJob(pending->first, pending->second);
+            JobEntry *job = entry.second;
             cout << "[" << job->getJobId() << "] " << job->getCmdLine() << " : " << job->getProcessId() << " "
                  << difftime(time(nullptr), job->getTime()) << " secs ";
             if (job->isStoppedJob())
                 cout << "(stopped)";
             cout << endl;
         }
+        for (; pending != pendingJobs.end(); ++pending)
+            printPendingJob(pending->first, pending->second);
+    }
+
+    void printPendingJob(int jobId, const PendingJob &job) {
+        cout << "[" << jobId << "] " << job.cmdLine << " : waiting on";
+        for (int dependency: job.waitingOn)
+            cout << " " << dependency;
+        cout << endl;
     }
 
-    static bool sortJobEntryByTime(JobEntry *a, JobEntry *b) {
-        return a->sortTime(b);
+    //takes jobId for cmd_line, which starts once every job of waitingOn finished successfully
+    void addPendingJob(int jobId, const string &cmd_line, const set<int> &waitingOn) {
+        pendingJobs[jobId] = {cmd_line, waitingOn};
+        for (int dependency: waitingOn)
+            dependents[dependency].push_back(jobId);
+    }
+
+    bool pendingJobExist(int jobId) {
+        return pendingJobs.count(jobId) > 0;
+    }
+
+    PendingJob *getPendingJob(int jobId) {
+        auto pending = pendingJobs.find(jobId);
+        return pending == pendingJobs.end() ? nullptr : &pending->second;
+    }
+
+    //the pending jobs that waited on the finished job jobId, none of them waits on it any more
+    vector<int> takeDependents(int jobId) {
+        vector<int> waiting;
+        auto entry = dependents.find(jobId);
+        if (entry == dependents.end())
+            return waiting;
+        waiting.swap(entry->second);
+        dependents.erase(entry);
+        for (int pendingId: waiting) {
+            PendingJob *pending = getPendingJob(pendingId);
+            if (pending != nullptr)
+                pending->waitingOn.erase(jobId);
+        }
+        return waiting;
+    }
+
+    //forgets a pending job that starts or is canceled, and returns its command line
+    string removePendingJob(int jobId) {
+        auto pending = pendingJobs.find(jobId);
+        if (pending == pendingJobs.end())
+            return "";
+        for (int dependency: pending->second.waitingOn) {
+            auto waiting = dependents.find(dependency);
+            if (waiting == dependents.end())
+                continue;
+            waiting->second.erase(remove(waiting->second.begin(), waiting->second.end(), jobId),
+                                  waiting->second.end());
+            if (waiting->second.empty())
+                dependents.erase(waiting);
+        }
+        string cmd_line = pending->second.cmdLine;
+        pendingJobs.erase(pending);
+        return cmd_line;
     }
 
     void killAllJobs() {
-        removeFinishedJobs();
-        std::sort(list.begin(), list.end());
-        cout << "sending SIGKILL signal to " << list.size() << " jobs:" << endl;
-        for (JobEntry *job: list) {
+        cout << "smash: sending SIGKILL signal to " << orderedJobs.size() << " jobs:" << endl;
+        for (auto &entry: orderedJobs) {
+            JobEntry *job = entry.second;
             pid_t pid = job->getProcessId();
             cout << pid << ": " << job->getCmdLine() << endl;
-            if (kill(pid, SIGKILL) == -1)
+            if (signalJob(job, SIGKILL, true) == FAILURE)
                 perror("smash error: kill failed");
         }
     }
 
     bool jobExist(int jobId) {
-        for (JobEntry *job: list)
-            if (job->getJobId() == jobId)
-                return true;
-        return false;
+        return jobsById.count(jobId) > 0;
     }
 
-    void removeFinishedJobs() {
-        int pos = 0;
-        for (JobEntry *job: list) {
-            if (waitpid(job->getProcessId(), nullptr, WNOHANG) > 0) {
-                removeJobByPos(pos);
-                pos--;
+    //true when cmd belongs to one of the jobs, so it must not be deleted by anyone else
+    bool ownsCommand(Command *cmd) {
+        JobEntry *job = getJobByPid(cmd->getPid());
+        return job != nullptr && job->getCommand() == cmd;
+    }
+
+    void addProcess(pid_t pid, pid_t pgid) {
+        processGroups[pid] = pgid;
+        groupSizes[pgid]++;
+    }
+
+    //true while at least one process of group pgid was not reaped yet
+    bool isGroupAlive(pid_t pgid) {
+        return groupSizes.count(pgid) > 0;
+    }
+
+    //returns the process group of pid, or FAILURE for a process smash did not launch
+    pid_t getProcessGroup(pid_t pid) {
+        auto process = processGroups.find(pid);
+        return process == processGroups.end() ? FAILURE : process->second;
+    }
+
+    /**
+     * Sends sig to the job through its pidfd, so a recycled pid is never signalled. Once the job's
+     * leader is gone, wholeGroup falls back to killpg, but only while a child of smash is still in
+     * the group: the kernel does not reuse the id of a process group that has members.
+     */
+    int signalJob(JobEntry *job, int sig, bool wholeGroup) {
+        pid_t pgid = job->getProcessId();
+        if (groupSizes.count(pgid) == 0) {
+            errno = ESRCH;
+            return FAILURE;
+        }
+        if (job->getPidfd() != FAILURE) {
+            if (_pidfdSendSignal(job->getPidfd(), sig, wholeGroup ? PIDFD_SIGNAL_PROCESS_GROUP : 0) == 0)
+                return 0;
+            //EINVAL is a kernel without process group support in pidfd_send_signal
+            if (!wholeGroup || (errno != ESRCH && errno != EINVAL))
+                return FAILURE;
+            siginfo_t info;
+            if (errno == ESRCH && waitid(P_PGID, pgid, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT)
+                                  == FAILURE) {
+                errno = ESRCH;
+                return FAILURE;
             }
-            pos++;
         }
+        return wholeGroup ? killpg(pgid, sig) : kill(pgid, sig);
     }
 
-    JobEntry *getJobById(int jobId) {
-        auto job = list.begin();
-        while (job != list.end()) {
-            if ((*job)->getJobId() == jobId)
-                return *job;
-            job++;
+    //stops watching the pidfd of a job whose leader terminated
+    void closeJobPidfd(JobEntry *job) {
+        if (job->getPidfd() == FAILURE)
+            return;
+        if (epollFd != FAILURE)
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, job->getPidfd(), nullptr);
+        job->closePidfd();
+    }
+
+    //forgets a terminated process, returns true when it was the last one of its process group
+    bool removeProcess(pid_t pid, const struct rusage *usage = nullptr) {
+        auto process = processGroups.find(pid);
+        if (process == processGroups.end())
+            return false;
+        pid_t pgid = process->second;
+        processGroups.erase(process);
+        if (--groupSizes[pgid] > 0) {
+            if (usage != nullptr)
+                groupUsages[pgid].add(*usage);
+            return false;
         }
-        return nullptr;
+        groupSizes.erase(pgid);
+        groupUsages.erase(pgid);
+        return true;
     }
 
-    void removeJobByPos(int pos) {
-        delete list[pos];
-        list.erase(list.begin() + pos);
+    /**
+     * Prints every job with what it used so far: its reaped processes plus a /proc sample of the live
+     * ones. asJson prints a single JSON array instead of one line per job.
+     */
+    void printJobsUsage(bool asJson);
+
+    JobEntry *getJobById(int jobId) {
+        auto job = jobsById.find(jobId);
+        return job == jobsById.end() ? nullptr : job->second;
     }
 
-    void removeJobById(int jobId) {
-        for (int pos=0; pos<list.size();pos++) {
-            JobEntry* job =list[pos];
-            if (jobId == job->getJobId()) {
-                delete list[pos];
-                list.erase(list.begin() + pos);
-            }
-            pos++;
-        }
+    JobEntry *getJobByPid(pid_t pid) {
+        auto job = jobsByPid.find(pid);
+        return job == jobsByPid.end() ? nullptr : job->second;
     }
 
-    JobEntry *getLastJob(int *lastJobId);
+    //removes the job but hands its command to the caller instead of deleting it
+    Command *releaseJob(int jobId) {
+        JobEntry *job = getJobById(jobId);
+        if (job == nullptr)
+            return nullptr;
+        Command *cmd = job->getCommand();
+        closeJobPidfd(job);
+        jobsById.erase(jobId);
+        jobsByPid.erase(job->getProcessId());
+        orderedJobs.erase(jobId);
+        stoppedJobIds.erase(jobId);
+        delete job;
+        return cmd;
+    }
 
-    JobEntry *getLastStoppedJob(int *jobId) {
+    void removeJobById(int jobId) {
+        delete releaseJob(jobId);
+    }
 
-        sort(list.begin(), list.end(), sortJobEntryByTime);
-        int i = list.size();
-        while (i > 0) {
-            if (list[i - 1]->isStoppedJob()) {
-                *jobId = list[i - 1]->getJobId();
-                return list[i - 1];
-            }
-            i--;
-        }
-        return nullptr;
+    JobEntry *getLastStoppedJob(int *jobId) {
+        if (stoppedJobIds.empty())
+            return nullptr;
+        *jobId = *stoppedJobIds.rbegin();
+        return getJobById(*jobId);
     }
 
     JobEntry *getMaxJobById() {
-        auto max = list.begin();
-        auto job = list.begin();
-        while (job != list.end()) {
-            if (max < job)
-                max = job;
-            job++;
-        }
-        return *max;
+        return orderedJobs.empty() ? nullptr : orderedJobs.rbegin()->second;
+    }
+
+    void setJobStopped(JobEntry *job, bool isStopped) {
+        job->setStopped(isStopped);
+        if (isStopped)
+            stoppedJobIds.insert(job->getJobId());
+        else
+            stoppedJobIds.erase(job->getJobId());
     }
 
     class JobEntry {
         int jobId;
         Command *cmd;
-        time_t timeInserted;
         bool isStopped;
+        time_t timeInserted;
+        //refers to the process itself rather than to its pid, FAILURE without pidfd support
+        int pidfd;
+        //one of the processes of the job did not exit with 0, like a foreground line with pipefail
+        bool hasFailed;
     public:
         JobEntry(int pid, int jobId, Command *cmd, bool isStopped, time_t timeInserted = time(nullptr))
                 : jobId(jobId), cmd(cmd),
                   isStopped(isStopped),
-                  timeInserted(timeInserted) {
+                  timeInserted(timeInserted), hasFailed(false) {
             cmd->setPid(pid);
+            //the process is an unreaped child of smash, so its pid can not have been recycled yet
+            pidfd = _pidfdOpen(pid);
         }
 
         int getProcessId() {
             return cmd->getPid();
         }
 
-        ~JobEntry() = default;
+        ~JobEntry() {
+            closePidfd();
+        }
+
+        int getPidfd() {
+            return pidfd;
+        }
+
+        void closePidfd() {
+            if (pidfd != FAILURE)
+                close(pidfd);
+            pidfd = FAILURE;
+        }
 
-        bool operator<(const JobEntry &other) {
+        bool operator<(const JobEntry &other) const {
             return jobId < other.jobId;
         }
 
@@ -338,6 +787,14 @@ public:
             return cmd;
         }
 
+        bool isFailed() {
+            return hasFailed;
+        }
+
+        void setFailed() {
+            hasFailed = true;
+        }
+
         time_t getTime() const {
             return timeInserted;
         }
@@ -346,12 +803,9 @@ public:
             return isStopped;
         }
 
-        void setNotStopped() {
-            isStopped = false;
-        }
-
-        bool sortTime(const JobEntry *other) {
-            return difftime(getTime(), other->getTime()) > 0;
+        //use JobsList::setJobStopped, which keeps the stopped jobs index in sync
+        void setStopped(bool stopped) {
+            isStopped = stopped;
         }
     };
 };
@@ -399,29 +853,389 @@ public:
 
 class TailCommand : public BuiltInCommand {
 public:
-    TailCommand(const char *cmd_line);
+    TailCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
 
     virtual ~TailCommand() {}
 
     void execute() override;
 };
 
+/**
+ * Remembers the absolute path every command name resolved to, like the hash builtin of bash.
+ * The table is dropped as soon as PATH changes, and a single entry is dropped when launching its
+ * cached path fails with ENOENT.
+ */
+class PathHashTable {
+    struct HashEntry {
+        string path;
+        int hits;
+    };
+    unordered_map<string, HashEntry> table;
+    string cachedPathVar;
+    long hitsCount;
+    long missesCount;
+
+    void validatePathVar();
+
+public:
+    PathHashTable() : hitsCount(0), missesCount(0) {}
+
+    ~PathHashTable() = default;
+
+    //returns the absolute path of name, or an empty string when it is not found in PATH
+    string lookup(const string &name);
+
+    void forget(const string &name) {
+        table.erase(name);
+    }
+
+    void clear() {
+        table.clear();
+        hitsCount = 0;
+        missesCount = 0;
+    }
+
+    void printTable();
+};
+
+class HashCommand : public BuiltInCommand {
+    PathHashTable *hashTable;
+public:
+    HashCommand(const char *cmd_line, PathHashTable *hashTable) : BuiltInCommand(cmd_line), hashTable(hashTable) {}
+
+    virtual ~HashCommand() {}
+
+    void execute() override;
+};
+
 class TouchCommand : public BuiltInCommand {
 public:
-    TouchCommand(const char *cmd_line);
+    TouchCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
 
     virtual ~TouchCommand() {}
 
     void execute() override;
 };
 
+/**
+ * Every pending deadline of the timeout builtin, in a min-heap driven by a single timerfd that is
+ * always armed to the earliest one. A deadline is cancelled in O(1) when its process group finishes
+ * first, cancelled entries are dropped lazily once they reach the top of the heap.
+ */
+class TimeoutsList {
+public:
+    struct TimeoutEntry {
+        //CLOCK_MONOTONIC nanoseconds
+        long long deadline;
+        unsigned long long id;
+        pid_t pgid;
+        string cmd_line;
+
+        bool operator>(const TimeoutEntry &other) const {
+            return deadline > other.deadline;
+        }
+    };
+private:
+    priority_queue<TimeoutEntry, vector<TimeoutEntry>, greater<TimeoutEntry>> deadlines;
+    //the id of the live deadline of every process group, any other entry was cancelled
+    unordered_map<pid_t, unsigned long long> activeIds;
+    unsigned long long nextId;
+    int timerFd;
+
+    void arm();
+
+public:
+    TimeoutsList();
+
+    ~TimeoutsList() {
+        if (timerFd != FAILURE)
+            close(timerFd);
+    }
+
+    TimeoutsList(TimeoutsList const &) = delete;
+
+    void operator=(TimeoutsList const &) = delete;
+
+    int getTimerFd() {
+        return timerFd;
+    }
+
+    //kills process group pgid once seconds passed, unless it finished before
+    void addTimeout(pid_t pgid, double seconds, const string &cmd_line);
+
+    void cancel(pid_t pgid) {
+        //no alarm for a deadline nobody waits for anymore
+        if (activeIds.erase(pgid) > 0 && deadlines.top().pgid == pgid)
+            arm();
+    }
+
+    //pops the next live deadline that already passed, and rearms the timer when there is none left
+    bool popExpired(TimeoutEntry *entry);
+
+    int size() {
+        return activeIds.size();
+    }
+};
+
+/**
+ * after <job-id...> [--] <command>: submits the command as a pending job, started in the background once
+ * every given job finished successfully, and canceled together with its own dependents once one did not.
+ */
+class AfterCommand : public BuiltInCommand {
+    JobsList *jobs;
+public:
+    AfterCommand(const char *cmd_line, JobsList *jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~AfterCommand() {}
+
+    void execute() override;
+};
+
+class TimeoutCommand : public Command {
+    TimeoutsList *timeouts;
+public:
+    TimeoutCommand(const char *cmd_line, TimeoutsList *timeouts) : Command(cmd_line), timeouts(timeouts) {}
+
+    virtual ~TimeoutCommand() {}
+
+    void execute() override;
+};
+
+//runs the rest of the line and reports its wall clock, user and sys times on stderr, like bash does
+class TimeCommand : public BuiltInCommand {
+public:
+    TimeCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~TimeCommand() {}
+
+    void execute() override;
+};
+
+/**
+ * bench -n runs [-w warmup] command: runs the rest of the line over and over through executeCommand,
+ * with its output discarded, and summarizes the wall clock times of the measured runs.
+ */
+class BenchCommand : public BuiltInCommand {
+public:
+    BenchCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~BenchCommand() {}
+
+    void execute() override;
+};
+
+//stats [on | off | reset | trace file | trace off], prints the latency histograms without arguments
+class StatsCommand : public BuiltInCommand {
+public:
+    StatsCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~StatsCommand() {}
+
+    void execute() override;
+};
+
+//told about the process groups smash launched without making them jobs, like the jobs of parallel
+class ProcessGroupObserver {
+public:
+    virtual ~ProcessGroupObserver() = default;
+
+    //a process of group pgid terminated with status, isLast once no process of the group is left
+    virtual void onProcessExit(pid_t pgid, int status, bool isLast) = 0;
+};
+
+/**
+ * parallel [-j jobs] [-g] command [::: arg...]: runs command once per arg, with every {} replaced by
+ * the arg or the arg appended, keeping at most jobs of them running (the online CPUs by default).
+ * Without ::: the args are the lines of the input, read while the first jobs already run. A new job
+ * starts as soon as the exit of another one is reaped. -g keeps the output of every job until it
+ * finished, so the outputs of jobs never interleave. The exit status of every job and the throughput
+ * are reported on stderr, like time reports.
+ */
+class ParallelCommand : public BuiltInCommand, public ProcessGroupObserver {
+    struct ParallelJob {
+        string cmd_line;
+        //non zero once any of its processes failed
+        int status;
+        //the memfds the output of a grouped job waits in, FAILURE when it goes straight out
+        int outFd;
+        int errFd;
+    };
+    vector<ParallelJob> launched;
+    //the index in launched of the job every running process group belongs to
+    unordered_map<pid_t, size_t> running;
+    string cmdTemplate;
+    bool isGrouped;
+    long failedCount;
+
+    void startJob(const string &arg, int inFd);
+
+    void finishJob(size_t index);
+
+public:
+    ParallelCommand(const char *cmd_line) : BuiltInCommand(cmd_line), isGrouped(false), failedCount(0) {}
+
+    virtual ~ParallelCommand() {}
+
+    bool readsInput() const override {
+        return true;
+    }
+
+    void execute() override;
+
+    void onProcessExit(pid_t pgid, int status, bool isLast) override;
+};
+
+/**
+ * Splits the input of smash into lines. Whole blocks are read ahead, and every line is handed out
+ * straight from the block, without moving the rest of it.
+ */
+class LineReader {
+    int fd;
+    vector<char> buffer;
+    //the bytes read and not handed out yet are buffer[start, end)
+    size_t start;
+    size_t end;
+    //the file fd referred to when the reader was made, fd itself may be replaced by dup2 meanwhile
+    struct stat fileSt;
+    bool hasFileSt;
+public:
+    LineReader(int fd, size_t blockSize) : fd(fd), buffer(blockSize), start(0), end(0) {
+        hasFileSt = fstat(fd, &fileSt) == 0;
+    }
+
+    int getFd() {
+        return fd;
+    }
+
+    //true when otherFd refers to the file this reader reads
+    bool readsFileOf(int otherFd) {
+        struct stat st;
+        return hasFileSt && fstat(otherFd, &st) == 0 && st.st_dev == fileSt.st_dev && st.st_ino == fileSt.st_ino;
+    }
+
+    //the next complete line in the buffer without its new line, false when more input is needed
+    bool nextLine(string &line) {
+        char *newLine = (char *) memchr(buffer.data() + start, '\n', end - start);
+        if (newLine == nullptr)
+            return false;
+        line.assign(buffer.data() + start, newLine);
+        start = newLine - buffer.data() + 1;
+        return true;
+    }
+
+    //reads the next block, returns 0 on EOF
+    ssize_t fill();
+
+    //the last line of an input that does not end with a new line
+    bool lastLine(string &line) {
+        line.assign(buffer.data() + start, buffer.data() + end);
+        start = end;
+        return !line.empty();
+    }
+};
+
+/**
+ * The built-ins loaded from shared objects by "enable -f". Every name holds its own dlopen reference,
+ * so a library is unloaded together with the last of its names.
+ */
+class LoadableBuiltins {
+    struct LoadedBuiltin {
+        string path;
+        void *handle;
+        const struct smash_builtin *builtin;
+    };
+    map<string, LoadedBuiltin> table;
+public:
+    LoadableBuiltins() = default;
+
+    ~LoadableBuiltins() {
+        for (auto &loaded: table)
+            dlclose(loaded.second.handle);
+    }
+
+    LoadableBuiltins(LoadableBuiltins const &) = delete;
+
+    void operator=(LoadableBuiltins const &) = delete;
+
+    bool empty() {
+        return table.empty();
+    }
+
+    //the entry point of name, or nullptr when it was not loaded
+    const struct smash_builtin *find(const string &name) {
+        auto loaded = table.find(name);
+        return loaded == table.end() ? nullptr : loaded->second.builtin;
+    }
+
+    //returns an error message, empty on success
+    string load(const string &path, const string &name);
+
+    bool unload(const string &name);
+
+    void printTable();
+};
+
+class EnableCommand : public BuiltInCommand {
+    LoadableBuiltins *loadables;
+public:
+    EnableCommand(const char *cmd_line, LoadableBuiltins *loadables) : BuiltInCommand(cmd_line),
+                                                                      loadables(loadables) {}
+
+    virtual ~EnableCommand() {}
+
+    void execute() override;
+};
+
+//a built-in loaded by "enable -f", it runs inside smash with its current stdio fds
+class PluginCommand : public BuiltInCommand {
+    const struct smash_builtin *builtin;
+public:
+    PluginCommand(const char *cmd_line, const struct smash_builtin *builtin) : BuiltInCommand(cmd_line),
+                                                                              builtin(builtin) {}
+
+    virtual ~PluginCommand() {}
+
+    void execute() override;
+};
 
 class SmallShell {
 private:
+    //creates the built-ins, out of the state of the shell
+    friend class BuiltinRegistry;
+
     string prompt;
     string plastPwd;
     JobsList *jobs;
-    JobEntry* currForegroundCommand;
+    PathHashTable *hashTable;
+    TimeoutsList *timeouts;
+    LoadableBuiltins *loadables;
+    Command *currForegroundCommand;
+    int fgJobId;
+    pid_t pid;
+    int signalFd;
+    int epollFd;
+    //exit status of the last command line, and whether a failing one ends smash (set -e)
+    int lastStatus;
+    bool failFast;
+    //what the reaped processes of the foreground command used, for time and bench
+    ResourceUsage foregroundUsage;
+    //ctrl-C and ctrl-Z presses so far, a command that loops stops once the count changes
+    unsigned long interruptsCount;
+    //told about every terminated process, nullptr while nobody asked
+    ProcessGroupObserver *groupObserver;
+    //the lines run is executing, nullptr outside of it
+    LineReader *inputReader;
+
+    //usage is what a terminated child used, nullptr when it is unknown or the child only stopped
+    void onChildStateChange(pid_t childPid, int status, const struct rusage *usage = nullptr);
+
+    void onJobPidfdReady(pid_t pgid);
+
+    //launches a pending job whose dependencies all succeeded, under the job id it already has
+    void startPendingJob(int jobId);
+
+    //reads the next line while handling events, returns false at the end of the input
+    bool readCommandLine(LineReader &reader, string &cmd_line);
 
     SmallShell();
 
@@ -443,10 +1257,39 @@ public:
 //hagai: need to delete finished jobs before any execute
     void executeCommand(const char *cmd_line);
 
-    void setJobToForeground(char* cmd_line){
-       JobsList::JobEntry job(getpid(),getJobIdToSet(),cmd,time(nullptr),isStopped);
-        *currForegroundCommand= job;
+    /**
+     * Executes every line of fd until its end and returns the status of the last one.
+     * Prompts are printed only when isInteractive, a script is read in large blocks instead.
+     */
+    int run(int fd, bool isInteractive);
 
+    //the signalfd smash receives SIGCHLD, SIGINT, SIGTSTP and SIGALRM through, also sets up the events fd
+    void setSignalFd(int fd);
+
+    //an epoll fd that is readable whenever handleEvents has something to do
+    int getEventsFd() {
+        return epollFd;
+    }
+
+    //handles pending signals, job exits reported by pidfds and expired timeouts, never blocks
+    void handleEvents();
+
+    //collects every child that changed state and updates the jobs list, costs O(changed children)
+    void reapChildren();
+
+    //starts or cancels the pending jobs waiting on jobId, which just finished
+    void onJobFinished(int jobId, bool succeeded);
+
+    //kills and reports every job whose timeout passed
+    void onTimeoutsExpired();
+
+    //handles signals until the foreground job pgid finished, was stopped or was killed
+    void waitForeground(pid_t pgid);
+
+    //jobId is -1 for a command that was never inserted to the jobs list
+    void setJobToForeground(Command *cmd, int jobId = -1) {
+        currForegroundCommand = cmd;
+        fgJobId = jobId;
     }
 
     string getPrompt() {
@@ -473,6 +1316,14 @@ public:
         return jobs;
     }
 
+    PathHashTable *getHashTable() {
+        return hashTable;
+    }
+
+    TimeoutsList *getTimeouts() {
+        return timeouts;
+    }
+
     int getForegroundJobId() {
         return fgJobId;
     }
@@ -481,8 +1332,48 @@ public:
         return currForegroundCommand;
     }
 
+    int getLastStatus() {
+        return lastStatus;
+    }
+
+    void setLastStatus(int status) {
+        lastStatus = status;
+    }
+
+    void setFailFast(bool isFailFast) {
+        failFast = isFailFast;
+    }
+
     void resetForegroundJob() {
         currForegroundCommand = nullptr;
+        fgJobId = -1;
+    }
+
+    //returns what the foreground commands used since the last call
+    ResourceUsage takeForegroundUsage() {
+        ResourceUsage usage = foregroundUsage;
+        foregroundUsage = ResourceUsage();
+        return usage;
+    }
+
+    void countInterrupt() {
+        interruptsCount++;
+    }
+
+    unsigned long getInterruptsCount() {
+        return interruptsCount;
+    }
+
+    LineReader *getInputReader() {
+        return inputReader;
+    }
+
+    void setProcessGroupObserver(ProcessGroupObserver *observer) {
+        groupObserver = observer;
+    }
+
+    ProcessGroupObserver *getProcessGroupObserver() {
+        return groupObserver;
     }
     // TODO: add extra methods as needed
 };
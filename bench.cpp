@@ -0,0 +1,626 @@
+#include "Commands.h"
+#include "signals.h"
+#include "zygote.h"
+#include <time.h>
+#include <functional>
+#include <poll.h>
+#include <sstream>
+#include <climits>
+#include <sys/resource.h>
+
+using namespace std;
+
+/**
+ * Micro benchmarks for the hot paths of smash.
+ * Every scenario runs in-process against the SmallShell singleton, exactly as smash.cpp drives it.
+ */
+
+//every malloc of the process, operator new included, goes through here
+extern "C" void *__libc_malloc(size_t size);
+static long allocationsCount = 0;
+
+extern "C" void *malloc(size_t size) {
+    allocationsCount++;
+    return __libc_malloc(size);
+}
+
+static double _nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//total number of processes created on the machine since boot
+static long _forksCount() {
+    ifstream stat("/proc/stat");
+    string key;
+    long value;
+    while (stat >> key) {
+        if (key == "processes" && stat >> value)
+            return value;
+        stat.ignore(1 << 16, '\n');
+    }
+    return 0;
+}
+
+struct BenchResult {
+    string name;
+    int iterations;
+    double usPerOp;
+    double processesPerOp;
+    double allocsPerOp;
+    //scenario specific figures, like MB/s of a pipeline
+    vector<pair<string, double>> metrics;
+};
+
+static vector<BenchResult> results;
+//scenarios this machine cannot run and why, reported so a missing figure is not read as a regression
+static vector<pair<string, string>> skipped;
+
+static void skipBench(const string &name, const string &reason) {
+    cout << name << ": SKIPPED, " << reason << endl;
+    skipped.emplace_back(name, reason);
+}
+
+//prints the figure and attaches it to the result of the last scenario
+static void addMetric(const string &name, double value) {
+    cout << results.back().name << ": " << value << " " << name << endl;
+    results.back().metrics.emplace_back(name, value);
+}
+
+//returns the total elapsed time in us
+static double runBench(const string &name, int iterations, const function<void()> &fn) {
+    //the benchmarked commands write to smash's stdout, keep it out of the report
+    cout.flush();
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+    long forks = _forksCount();
+    long allocations = allocationsCount;
+    double start = _nowUs();
+    for (int i = 0; i < iterations; i++)
+        fn();
+    double elapsed = _nowUs() - start;
+    allocations = allocationsCount - allocations;
+    forks = _forksCount() - forks;
+    cout.flush();
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    results.push_back({name, iterations, elapsed / iterations, (double) forks / iterations,
+                       (double) allocations / iterations, {}});
+    cout << name << ": " << iterations << " iterations, " << elapsed / iterations << " us/op, "
+         << (double) forks / iterations << " processes/op, " << (double) allocations / iterations << " allocs/op"
+         << endl;
+    return elapsed;
+}
+
+#define STREAM_BYTES (16 << 20)
+
+//STREAM_BYTES through stages processes, every middle one a cat
+static string _pipelineCmdLine(int stages) {
+    string cmd_line = "head -c " + to_string(STREAM_BYTES) + " /dev/zero";
+    for (int i = 2; i < stages; i++)
+        cmd_line += " | cat";
+    return cmd_line + " | wc -c";
+}
+
+static void pipelineThroughput(int stages, int iterations) {
+    string cmd_line = _pipelineCmdLine(stages);
+    double elapsed = runBench("pipeline_" + to_string(stages) + "_stages", iterations, [&cmd_line]() {
+        SmallShell::getInstance().executeCommand(cmd_line.c_str());
+    });
+    addMetric("MB/s", (double) STREAM_BYTES * iterations / elapsed);
+}
+
+//the tail built-in copying a whole STREAM_BYTES file into a file and into a pipe, and just its end
+static void tailThroughput(int iterations) {
+    const char *path = "/tmp/smash_bench_tail.txt";
+    ofstream file(path);
+    string line(63, 'a');
+    for (int i = 0; i < STREAM_BYTES / 64; i++)
+        file << line << '\n';
+    file.close();
+    string lines = to_string(STREAM_BYTES / 64);
+    string toFile = "tail -" + lines + " " + path + " > /tmp/smash_bench_tail_copy.txt";
+    string toPipe = "tail -" + lines + " " + path + " | wc -c";
+    double elapsed = runBench("tail_to_file", iterations, [&toFile]() {
+        SmallShell::getInstance().executeCommand(toFile.c_str());
+    });
+    addMetric("MB/s", (double) STREAM_BYTES * iterations / elapsed);
+    elapsed = runBench("tail_to_pipe", iterations, [&toPipe]() {
+        SmallShell::getInstance().executeCommand(toPipe.c_str());
+    });
+    addMetric("MB/s", (double) STREAM_BYTES * iterations / elapsed);
+    //only the end of the file is read, however large it is
+    string lastLines = "tail -10 " + string(path) + " > /tmp/smash_bench_tail_copy.txt";
+    runBench("tail_last_10_lines", iterations * 100, [&lastLines]() {
+        SmallShell::getInstance().executeCommand(lastLines.c_str());
+    });
+    unlink(path);
+    unlink("/tmp/smash_bench_tail_copy.txt");
+}
+
+#define TOUCH_FILES_COUNT (100000)
+
+/**
+ * The touch built-in retiming TOUCH_FILES_COUNT files through a glob, against /usr/bin/touch run
+ * through ExternalCommand over the same glob, and against spawning /usr/bin/touch once per file.
+ * Runs inside the directory, the names bash expands have to fit in the argument list of one exec.
+ */
+static void touchFiles(int iterations) {
+    const char *dir = "/tmp/smash_bench_touch";
+    mkdir(dir, 0755);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr || chdir(dir) == FAILURE)
+        return;
+    for (int i = 0; i < TOUCH_FILES_COUNT; i++)
+        close(open(("f" + to_string(i)).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    double elapsed = runBench("touch_100k_builtin", iterations, []() {
+        SmallShell::getInstance().executeCommand("touch f* 30.5:0:12:1:1:2000");
+    });
+    addMetric("files/s", TOUCH_FILES_COUNT * iterations / (elapsed / 1e6));
+    elapsed = runBench("touch_100k_external", iterations, []() {
+        SmallShell::getInstance().executeCommand("/usr/bin/touch -d '2000-01-01 12:00:30.5' f*");
+    });
+    addMetric("files/s", TOUCH_FILES_COUNT * iterations / (elapsed / 1e6));
+    int perFile = min(TOUCH_FILES_COUNT, 1000);
+    int file = 0;
+    elapsed = runBench("touch_external_per_file", perFile, [&file]() {
+        string cmd_line = "/usr/bin/touch f" + to_string(file++);
+        SmallShell::getInstance().executeCommand(cmd_line.c_str());
+    });
+    addMetric("files/s", perFile / (elapsed / 1e6));
+    for (int i = 0; i < TOUCH_FILES_COUNT; i++)
+        unlink(("f" + to_string(i)).c_str());
+    chdir(cwd);
+    rmdir(dir);
+}
+
+//expanding a glob over TOUCH_FILES_COUNT files from the directory cache, from getdents64, and by bash
+static void globLargeDirectory(int iterations) {
+    const char *dir = "/tmp/smash_bench_glob";
+    mkdir(dir, 0755);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr || chdir(dir) == FAILURE)
+        return;
+    for (int i = 0; i < TOUCH_FILES_COUNT; i++)
+        close(open(("f" + to_string(i)).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    //the listing is only trusted once the clock moved past the mtime of the directory
+    usleep(20000);
+    delete SmallShell::getInstance().CreateCommand("/bin/true f*");
+    double elapsed = runBench("glob_100k_cached", iterations, []() {
+        delete SmallShell::getInstance().CreateCommand("/bin/true f*");
+    });
+    addMetric("files/s", TOUCH_FILES_COUNT * iterations / (elapsed / 1e6));
+    elapsed = runBench("glob_100k_uncached", iterations, []() {
+        DirectoryCache::getInstance().clear();
+        delete SmallShell::getInstance().CreateCommand("/bin/true f*");
+    });
+    addMetric("files/s", TOUCH_FILES_COUNT * iterations / (elapsed / 1e6));
+    //the ; sends the line through bash -c, which expands the glob itself
+    elapsed = runBench("glob_100k_bash", iterations, []() {
+        SmallShell::getInstance().executeCommand("/bin/true f*;");
+    });
+    addMetric("files/s", TOUCH_FILES_COUNT * iterations / (elapsed / 1e6));
+    for (int i = 0; i < TOUCH_FILES_COUNT; i++)
+        unlink(("f" + to_string(i)).c_str());
+    chdir(cwd);
+    rmdir(dir);
+}
+
+#define PARALLEL_JOBS_COUNT (1000)
+
+//PARALLEL_JOBS_COUNT /bin/true through parallel with a growing limit, against running them one by one
+static void parallelJobs(int iterations) {
+    string sequential = "/bin/true " + to_string(PARALLEL_JOBS_COUNT);
+    double elapsed = runBench("parallel_sequential_1k", iterations, [&sequential]() {
+        for (int i = 0; i < PARALLEL_JOBS_COUNT; i++)
+            SmallShell::getInstance().executeCommand(sequential.c_str());
+    });
+    addMetric("jobs/s", PARALLEL_JOBS_COUNT * iterations / (elapsed / 1e6));
+    //the per job report of parallel would drown the results
+    int savedStderr = dup(STDERR_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    long limits[] = {1, 4, 16};
+    for (long limit: limits) {
+        string cmd_line = "parallel -j " + to_string(limit) + " /bin/true ::: {1.." +
+                          to_string(PARALLEL_JOBS_COUNT) + "}";
+        dup2(devNull, STDERR_FILENO);
+        elapsed = runBench("parallel_j" + to_string(limit) + "_1k", iterations, [&cmd_line]() {
+            SmallShell::getInstance().executeCommand(cmd_line.c_str());
+        });
+        dup2(savedStderr, STDERR_FILENO);
+        addMetric("jobs/s", PARALLEL_JOBS_COUNT * iterations / (elapsed / 1e6));
+    }
+    close(devNull);
+    close(savedStderr);
+}
+
+//one producer feeding consumers consumers through |>, MB/s counts the producer's bytes once
+static void fanOutThroughput(int consumers, int iterations) {
+    string cmd_line = "head -c " + to_string(STREAM_BYTES) + " /dev/zero |> (wc -c";
+    for (int i = 1; i < consumers; i++)
+        cmd_line += ", wc -c";
+    cmd_line += ")";
+    double elapsed = runBench("fanout_" + to_string(consumers) + "_consumers", iterations, [&cmd_line]() {
+        SmallShell::getInstance().executeCommand(cmd_line.c_str());
+    });
+    addMetric("MB/s", (double) STREAM_BYTES * iterations / elapsed);
+}
+
+static void redirectionThroughput(int iterations) {
+    string cmd_line = "head -c " + to_string(STREAM_BYTES) + " /dev/zero > /tmp/smash_bench_redirection.txt";
+    double elapsed = runBench("redirection", iterations, [&cmd_line]() {
+        SmallShell::getInstance().executeCommand(cmd_line.c_str());
+    });
+    addMetric("MB/s", (double) STREAM_BYTES * iterations / elapsed);
+    unlink("/tmp/smash_bench_redirection.txt");
+}
+
+static void externalLaunchSimple() {
+    SmallShell::getInstance().executeCommand("/bin/true");
+}
+
+//the quoted argument forces the line through bash -c
+static void externalLaunchShell() {
+    SmallShell::getInstance().executeCommand("/bin/true ''");
+}
+
+static void tokenizeLine() {
+    Command *cmd = SmallShell::getInstance().CreateCommand("  sleep 100 first-argument second \"third arg\" &");
+    delete cmd;
+}
+
+//one line per built-in, plus a line of every other kind CreateCommand tells apart
+static const char *dispatchLines[] = {"pwd", "showpid", "chprompt bench", "cd /tmp", "kill -9 1", "jobs", "fg 1", "bg 1",
+                                      "quit", "tail -5 /tmp/file", "touch /tmp/file 0:0:12:1:1:2000", "hash -r",
+                                      "set -e", "export A=1", "enable", "stats", "parallel echo ::: a b",
+                                      "after 1 -- echo done", "timeout 1 sleep 1", "time pwd", "bench -n 1 pwd",
+                                      "sleep 1 &", "ls | wc -l", "seq 3 |> (cat, wc -l)", "pwd > /dev/null"};
+
+#define DISPATCH_LINES_COUNT (sizeof(dispatchLines) / sizeof(dispatchLines[0]))
+
+static void dispatchCommands() {
+    SmallShell &smash = SmallShell::getInstance();
+    for (const char *cmd_line: dispatchLines)
+        delete smash.CreateCommand(cmd_line);
+}
+
+static string _longCmdLine(const string &program, int argsCount, size_t argLength, size_t *outputSize) {
+    string cmd_line = program;
+    *outputSize = 0;
+    for (int i = 0; i < argsCount; i++) {
+        string arg = to_string(i);
+        arg.resize(argLength, 'a');
+        cmd_line += " " + arg;
+        *outputSize += arg.size() + 1;
+    }
+    return cmd_line;
+}
+
+//launches echo with argsCount arguments and checks every one of them arrived
+static void stressLaunchArgs(int argsCount, int iterations) {
+    size_t expected;
+    string cmd_line = _longCmdLine("/bin/echo", argsCount, 8, &expected) + " > /tmp/smash_bench_args.txt";
+    runBench("launch_" + to_string(argsCount) + "_args", iterations, [&cmd_line]() {
+        SmallShell::getInstance().executeCommand(cmd_line.c_str());
+    });
+    struct stat st;
+    if (stat("/tmp/smash_bench_args.txt", &st) == FAILURE || (size_t) st.st_size != expected)
+        cout << "launch_" << argsCount << "_args: FAILED, output does not match the arguments" << endl;
+    unlink("/tmp/smash_bench_args.txt");
+}
+
+static void stressTokenizeBytes(size_t bytes, int iterations) {
+    size_t lineSize;
+    string cmd_line = _longCmdLine("/bin/true", bytes / 40, 39, &lineSize);
+    runBench("tokenize_" + to_string(bytes >> 10) + "KB_line", iterations, [&cmd_line]() {
+        delete SmallShell::getInstance().CreateCommand(cmd_line.c_str());
+    });
+}
+
+/**
+ * Jobs list operations on 10k jobs with made up pids, no processes involved. addJob still calls
+ * pidfd_open for every entry, which fails with ESRCH, so the figure includes 10k of those syscalls.
+ */
+static void jobsTable10kPidfdOpen() {
+    const int jobsCount = 10000;
+    JobsList jobs;
+    for (int i = 0; i < jobsCount; i++) {
+        Command *cmd = new ExternalCommand("sleep 100&");
+        jobs.addJob(cmd, jobs.getJobIdToSet(), 1000000 + i, i % 2 == 0);
+    }
+    int jobId;
+    for (int i = 0; i < jobsCount; i++) {
+        jobs.getJobById((i * 7919) % jobsCount + 1);
+        jobs.getLastStoppedJob(&jobId);
+    }
+    jobs.printJobsList();
+    for (int i = jobsCount; i > 0; i--)
+        jobs.removeJobById(i);
+}
+
+//creates 10k real background jobs and reaps them all
+static void jobsSpawnReap10k() {
+    SmallShell &smash = SmallShell::getInstance();
+    for (int i = 0; i < 10000; i++)
+        smash.executeCommand("/bin/true&");
+    while (!smash.getJobList()->empty()) {
+        struct pollfd pfd = {smash.getEventsFd(), POLLIN, 0};
+        poll(&pfd, 1, -1);
+        smash.handleEvents();
+    }
+}
+
+//pure deadline bookkeeping: 100k deadlines armed, every other one cancelled, the rest popped
+static void timeoutsHeap100k() {
+    const int timeoutsCount = 100000;
+    TimeoutsList timeouts;
+    for (int i = 0; i < timeoutsCount; i++)
+        timeouts.addTimeout(1000000 + i, 1e-6 * ((i * 7919) % timeoutsCount), "sleep 100");
+    for (int i = 0; i < timeoutsCount; i += 2)
+        timeouts.cancel(1000000 + i);
+    usleep(100000);
+    TimeoutsList::TimeoutEntry timeout;
+    while (timeouts.popExpired(&timeout));
+}
+
+//1k real background jobs bounded by a timeout, all of them killed by the timer
+static void timeoutsKill1k() {
+    SmallShell &smash = SmallShell::getInstance();
+    for (int i = 0; i < 1000; i++)
+        smash.executeCommand("timeout 0.5 sleep 100&");
+    while (!smash.getJobList()->empty()) {
+        struct pollfd pfd = {smash.getEventsFd(), POLLIN, 0};
+        poll(&pfd, 1, -1);
+        smash.handleEvents();
+    }
+}
+
+//runs a generated script of linesCount built-in lines through the batch mode of smash
+static void scriptThroughput(int linesCount) {
+    const char *lines[] = {"chprompt bench", "cd .", "showpid > /dev/null", "jobs"};
+    string path = "/tmp/smash_bench_script.txt";
+    ofstream script(path);
+    for (int i = 0; i < linesCount; i++)
+        script << lines[i % 4] << '\n';
+    script.close();
+    string name = "script_" + to_string(linesCount / 1000) + "k_lines";
+    double elapsed = runBench(name, 1, [&path]() {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        SmallShell::getInstance().run(fd, false);
+        close(fd);
+    });
+    addMetric("lines/s", (long) (linesCount / (elapsed / 1e6)));
+    unlink(path.c_str());
+}
+
+//the same small tool, launched as an external binary and run in-process as a plugin of enable -f
+static void toolExternalVsPlugin(int iterations) {
+    SmallShell &smash = SmallShell::getInstance();
+    const char *cmd_line = "basename /usr/lib/libc.so .so";
+    runBench("tool_external", iterations, [cmd_line, &smash]() {
+        smash.executeCommand(cmd_line);
+    });
+    smash.executeCommand("enable -f ./libsmash_sample.so basename");
+    if (smash.getLastStatus() != 0) {
+        skipBench("tool_plugin", "build the sample plugin with make plugins");
+        return;
+    }
+    runBench("tool_plugin", iterations * 100, [cmd_line, &smash]() {
+        smash.executeCommand(cmd_line);
+    });
+    smash.executeCommand("enable -d basename");
+}
+
+static long _rssMb() {
+    ifstream statm("/proc/self/statm");
+    long size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE) >> 20;
+}
+
+static void _launchBothWays(const string &suffix, int iterations) {
+    Zygote &zygote = Zygote::getInstance();
+    zygote.setEnabled(false);
+    runBench("launch_direct_" + suffix, iterations, externalLaunchSimple);
+    zygote.setEnabled(true);
+    runBench("launch_zygote_" + suffix, iterations, externalLaunchSimple);
+}
+
+//raises the soft RLIMIT_NOFILE up to the hard one so count more fds fit, false if they do not
+static bool _reserveFds(rlim_t count, string *reason) {
+    const rlim_t spareFds = 64;
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= count + spareFds)
+        return true;
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? count + spareFds : min(limit.rlim_max, count + spareFds);
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur >= count + spareFds)
+        return true;
+    *reason = "needs " + to_string(count) + " fds, RLIMIT_NOFILE is " + to_string(limit.rlim_cur);
+    return false;
+}
+
+/**
+ * Launch latency while smash grows in memory and in open fds, by smash itself and through the zygote.
+ * Sizes above a quarter of the RAM of the machine or above its RLIMIT_NOFILE are skipped, the figures
+ * would measure swapping or a failing open instead of the launch.
+ */
+static void launchVsSmashSize(int iterations) {
+    const size_t blockSize = 64 << 20;
+    size_t ramMb = (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) >> 20;
+    vector<char *> blocks;
+    size_t sizesMb[] = {0, 512, 2048};
+    for (size_t sizeMb: sizesMb) {
+        if (sizeMb > ramMb / 4) {
+            skipBench("launch_rss_" + to_string(sizeMb) + "MB", "needs 4x its size in RAM, the machine has " +
+                                                                  to_string(ramMb) + "MB");
+            continue;
+        }
+        while (blocks.size() * (blockSize >> 20) < sizeMb) {
+            blocks.push_back(new char[blockSize]);
+            memset(blocks.back(), 1, blockSize);
+        }
+        _launchBothWays("rss_" + to_string(_rssMb()) + "MB", iterations);
+    }
+    for (char *block: blocks)
+        delete[] block;
+    const int fdsCount = 10000;
+    string reason;
+    if (!_reserveFds(fdsCount, &reason)) {
+        skipBench("launch_10k_fds", reason);
+        return;
+    }
+    vector<int> fds;
+    for (int i = 0; i < fdsCount; i++)
+        fds.push_back(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    _launchBothWays("10k_fds", iterations);
+    for (int fd: fds)
+        close(fd);
+}
+
+/**
+ * How long smash takes from the moment sig reaches it until executeCommand of the foreground job
+ * returns. A timer raises sig at a known instant a few ms after the job was launched, the way the
+ * terminal does for ctrl-C and ctrl-Z.
+ */
+static void signalLatency(const string &name, int sig, int iterations) {
+    SmallShell &smash = SmallShell::getInstance();
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = sig;
+    timer_t timer;
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer) == FAILURE) {
+        perror("smash_bench: timer_create failed");
+        return;
+    }
+    double totalLatencyUs = 0;
+    runBench(name, iterations, [&]() {
+        struct itimerspec fire = {};
+        clock_gettime(CLOCK_MONOTONIC, &fire.it_value);
+        fire.it_value.tv_nsec += 5000000;
+        if (fire.it_value.tv_nsec >= 1000000000) {
+            fire.it_value.tv_sec++;
+            fire.it_value.tv_nsec -= 1000000000;
+        }
+        timer_settime(timer, TIMER_ABSTIME, &fire, nullptr);
+        smash.executeCommand("sleep 100");
+        totalLatencyUs += _nowUs() - (fire.it_value.tv_sec * 1e6 + fire.it_value.tv_nsec / 1e3);
+        //a stopped job stays in the list, it is killed and reaped before the next round
+        JobsList::JobEntry *stopped = smash.getJobList()->getMaxJobById();
+        if (stopped != nullptr)
+            smash.executeCommand(("kill -9 " + to_string(stopped->getJobId())).c_str());
+        while (!smash.getJobList()->empty()) {
+            struct pollfd pfd = {smash.getEventsFd(), POLLIN, 0};
+            poll(&pfd, 1, -1);
+            smash.handleEvents();
+        }
+    });
+    timer_delete(timer);
+    addMetric("latency_us", totalLatencyUs / iterations);
+}
+
+static void pathLookupCached() {
+    SmallShell::getInstance().getHashTable()->lookup("true");
+}
+
+static void pathLookupUncached() {
+    PathHashTable *hashTable = SmallShell::getInstance().getHashTable();
+    hashTable->forget("true");
+    hashTable->lookup("true");
+}
+
+static string _jsonString(const string &text) {
+    string ret = "\"";
+    for (char c: text) {
+        if (c == '"' || c == '\\')
+            ret += '\\';
+        ret += c;
+    }
+    return ret + "\"";
+}
+
+//one object per scenario, so runs of different versions of smash can be diffed scenario by scenario
+static void writeJsonReport(const string &path, const string &label, int iterations) {
+    ofstream report(path);
+    report << "{\"label\":" << _jsonString(label) << ",\"time\":" << time(nullptr) << ",\"iterations\":"
+           << iterations << ",\"results\":[";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &result = results[i];
+        report << (i == 0 ? "\n" : ",\n") << "{\"name\":" << _jsonString(result.name) << ",\"iterations\":"
+               << result.iterations << ",\"us_per_op\":" << result.usPerOp << ",\"processes_per_op\":"
+               << result.processesPerOp << ",\"allocs_per_op\":" << result.allocsPerOp;
+        for (auto &metric: result.metrics)
+            report << "," << _jsonString(metric.first) << ":" << metric.second;
+        report << "}";
+    }
+    report << "\n],\"skipped\":[";
+    for (size_t i = 0; i < skipped.size(); i++)
+        report << (i == 0 ? "\n" : ",\n") << "{\"name\":" << _jsonString(skipped[i].first) << ",\"reason\":"
+               << _jsonString(skipped[i].second) << "}";
+    report << "\n]}" << endl;
+}
+
+//smash_bench [iterations] [--json path] [--label label]
+int main(int argc, char *argv[]) {
+    Zygote::getInstance().start();
+    SmallShell::getInstance().setSignalFd(setupSignalFd());
+    int iterations = 1000;
+    string jsonPath, label;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+            label = argv[++i];
+        else
+            iterations = atoi(argv[i]);
+    }
+    runBench("external_launch_simple", iterations, externalLaunchSimple);
+    runBench("external_launch_shell", iterations, externalLaunchShell);
+    runBench("tokenize_line", iterations * 100, tokenizeLine);
+    string dispatchName = "dispatch_" + to_string(DISPATCH_LINES_COUNT) + "_lines";
+    runBench(dispatchName, iterations * 10, dispatchCommands);
+    //the cost of the latency probes themselves, against the line above
+    statsEnabled = true;
+    runBench(dispatchName + "_stats_on", iterations * 10, dispatchCommands);
+    statsEnabled = false;
+    toolExternalVsPlugin(iterations);
+    launchVsSmashSize(iterations);
+    runBench("path_lookup_cached", iterations * 100, pathLookupCached);
+    runBench("path_lookup_uncached", iterations * 100, pathLookupUncached);
+    int argsCounts[] = {1000, 10000, 100000};
+    for (int n: argsCounts)
+        stressLaunchArgs(n, max(1, iterations * 10 / n));
+    size_t lineSizes[] = {400 << 10, 4 << 20};
+    for (size_t size: lineSizes)
+        stressTokenizeBytes(size, max(1, (int) (iterations * 4000 / size)));
+    scriptThroughput(100000);
+    runBench("jobs_table_10k_pidfd_open", 1, jobsTable10kPidfdOpen);
+    //every live job holds a pidfd
+    string reason;
+    if (_reserveFds(10000, &reason))
+        runBench("jobs_spawn_reap_10k", 1, jobsSpawnReap10k);
+    else
+        skipBench("jobs_spawn_reap_10k", reason);
+    runBench("timeouts_heap_100k", 1, timeoutsHeap100k);
+    runBench("timeouts_kill_1k", 1, timeoutsKill1k);
+    int stages[] = {2, 8, 32};
+    for (int n: stages)
+        pipelineThroughput(n, max(1, iterations / 100));
+    int consumers[] = {1, 4};
+    for (int n: consumers)
+        fanOutThroughput(n, max(1, iterations / 100));
+    redirectionThroughput(max(1, iterations / 100));
+    tailThroughput(max(1, iterations / 100));
+    touchFiles(max(1, iterations / 1000));
+    globLargeDirectory(max(1, iterations / 100));
+    parallelJobs(max(1, iterations / 1000));
+    signalLatency("ctrl_c_foreground", SIGINT, max(1, iterations / 10));
+    signalLatency("ctrl_z_foreground", SIGTSTP, max(1, iterations / 10));
+    if (!jsonPath.empty())
+        writeJsonReport(jsonPath, label, iterations);
+    return 0;
+}
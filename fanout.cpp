@@ -0,0 +1,29 @@
+#include "transfer.h"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * The distributor of "producer |> (consumer, ...)". smash launches it like an external command, through
+ * the zygote, with the producer's pipe as stdin and the pipe of every consumer from FANOUT_FIRST_FD up,
+ * so smash itself never forks for a fan-out. Its only argument is the number of consumers.
+ */
+int main(int argc, char *argv[]) {
+    int count = argc == 2 ? atoi(argv[1]) : 0;
+    if (count <= 0) {
+        fprintf(stderr, "smash error: usage: %s consumers-count\n", argv[0]);
+        return 2;
+    }
+    std::vector<int> outFds;
+    for (int i = 0; i < count; i++)
+        outFds.push_back(FANOUT_FIRST_FD + i);
+    //a consumer that went away is an EPIPE to handle, not a reason to die
+    signal(SIGPIPE, SIG_IGN);
+    if (fanOutPipe(STDIN_FILENO, outFds.data(), count) == -1) {
+        perror("smash error: fan-out failed");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,448 @@
+#include "globbing.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+#define FAILURE -1
+
+//the record getdents64 fills the buffer with
+struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+bool mayNeedExpansion(const char *text) {
+    return strpbrk(text, "*?[{") != nullptr;
+}
+
+static bool _isBefore(const struct timespec &first, const struct timespec &second) {
+    return first.tv_sec < second.tv_sec || (first.tv_sec == second.tv_sec && first.tv_nsec < second.tv_nsec);
+}
+
+bool DirectoryCache::read(const string &dir, DirListing &listing) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == FAILURE)
+        return false;
+    //taken before the stat, a change after it gets an mtime no older than tick
+    struct timespec tick;
+    clock_gettime(CLOCK_REALTIME_COARSE, &tick);
+    struct stat dirStat;
+    if (fstat(fd, &dirStat) == FAILURE) {
+        close(fd);
+        return false;
+    }
+    if (buffer == nullptr)
+        buffer = new char[GLOB_DENTS_BUFFER_SIZE];
+    listing.entries.clear();
+    long bytes;
+    while ((bytes = syscall(SYS_getdents64, fd, buffer, GLOB_DENTS_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < bytes;) {
+            struct LinuxDirent64 *entry = (struct LinuxDirent64 *) (buffer + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            listing.entries.push_back({name, entry->d_type});
+        }
+    }
+    close(fd);
+    if (bytes == FAILURE)
+        return false;
+    //sorted once here, the matches of a glob over a single directory come out in bash's order already
+    sort(listing.entries.begin(), listing.entries.end(), [](const DirEntry &a, const DirEntry &b) {
+        return strcoll(a.name.c_str(), b.name.c_str()) < 0;
+    });
+    listing.device = dirStat.st_dev;
+    listing.inode = dirStat.st_ino;
+    listing.mtime = dirStat.st_mtim;
+    listing.isTrusted = _isBefore(dirStat.st_mtim, tick);
+    return true;
+}
+
+const vector<DirEntry> *DirectoryCache::list(const string &dir) {
+    struct stat dirStat;
+    if (stat(dir.c_str(), &dirStat) == FAILURE || !S_ISDIR(dirStat.st_mode))
+        return nullptr;
+    auto cached = listings.find(dir);
+    //the inode tells a relative path apart after a cd
+    if (cached != listings.end() && cached->second.isTrusted && cached->second.device == dirStat.st_dev &&
+        cached->second.inode == dirStat.st_ino && cached->second.mtime.tv_sec == dirStat.st_mtim.tv_sec &&
+        cached->second.mtime.tv_nsec == dirStat.st_mtim.tv_nsec)
+        return &cached->second.entries;
+    DirListing &listing = listings[dir];
+    if (!read(dir, listing)) {
+        listings.erase(dir);
+        return nullptr;
+    }
+    return &listing.entries;
+}
+
+//the closing ] of the bracket expression opened at p, nullptr when there is none and [ is literal
+static const char *_bracketEnd(const char *p) {
+    p++;
+    if (*p == '!' || *p == '^')
+        p++;
+    //a ] right after the opening is part of the set
+    if (*p == ']')
+        p++;
+    while (*p && *p != ']') {
+        if (p[0] == '[' && p[1] == ':') {
+            const char *close = strstr(p + 2, ":]");
+            if (close != nullptr) {
+                p = close + 2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1])
+            p++;
+        p++;
+    }
+    return *p == ']' ? p : nullptr;
+}
+
+static bool _isInClass(const char *name, size_t length, unsigned char c) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+                   {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+                   {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}};
+    for (auto &characterClass: classes) {
+        if (strlen(characterClass.name) == length && strncmp(characterClass.name, name, length) == 0)
+            return characterClass.test(c);
+    }
+    return false;
+}
+
+//whether c is in the bracket expression from p, its [, to end, its ]
+static bool _matchBracket(const char *p, const char *end, unsigned char c) {
+    p++;
+    bool negate = *p == '!' || *p == '^';
+    if (negate)
+        p++;
+    bool matched = false;
+    while (p < end) {
+        if (p[0] == '[' && p[1] == ':') {
+            const char *close = strstr(p + 2, ":]");
+            if (close != nullptr && close < end) {
+                matched |= _isInClass(p + 2, close - p - 2, c);
+                p = close + 2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p + 1 < end)
+            p++;
+        unsigned char low = *p++, high = low;
+        if (*p == '-' && p + 1 < end) {
+            p++;
+            if (*p == '\\' && p + 1 < end)
+                p++;
+            high = *p++;
+        }
+        matched |= low <= c && c <= high;
+    }
+    return matched != negate;
+}
+
+//matches a single path component, a leading dot of name only matches a literal dot
+static bool _matchName(const char *p, const char *name) {
+    if (name[0] == '.' && p[0] != '.' && !(p[0] == '\\' && p[1] == '.'))
+        return false;
+    const char *starPattern = nullptr, *starName = nullptr;
+    while (*name) {
+        if (*p == '*') {
+            starPattern = ++p;
+            starName = name;
+            continue;
+        }
+        const char *next = p + 1;
+        bool matched;
+        const char *end;
+        if (*p == '?') {
+            matched = true;
+        } else if (*p == '[' && (end = _bracketEnd(p)) != nullptr) {
+            matched = _matchBracket(p, end, *name);
+            next = end + 1;
+        } else {
+            char literal = *p;
+            if (*p == '\\' && p[1]) {
+                literal = p[1];
+                next = p + 2;
+            }
+            matched = *p && literal == *name;
+        }
+        if (matched) {
+            p = next;
+            name++;
+            continue;
+        }
+        //let the last * take one more character
+        if (starPattern == nullptr)
+            return false;
+        p = starPattern;
+        name = ++starName;
+    }
+    while (*p == '*')
+        p++;
+    return *p == '\0';
+}
+
+static bool _hasGlob(const string &text) {
+    for (const char *p = text.c_str(); *p; p++) {
+        if (*p == '\\' && p[1])
+            p++;
+        else if (*p == '*' || *p == '?' || (*p == '[' && _bracketEnd(p) != nullptr))
+            return true;
+    }
+    return false;
+}
+
+static string _unescape(const string &text) {
+    string ret;
+    ret.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '\\' && i + 1 < text.size())
+            i++;
+        ret += text[i];
+    }
+    return ret;
+}
+
+struct PathComponent {
+    string pattern;
+    //the slashes after it as written, empty for the last one unless the word ends with a slash
+    string separator;
+};
+
+//a symbolic link to a directory is one, unless the walk of ** is not to follow it
+static bool _isDirectory(const string &path, unsigned char type, bool follow) {
+    if (type == DT_DIR)
+        return true;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow))
+        return false;
+    struct stat pathStat;
+    return (follow ? stat(path.c_str(), &pathStat) : lstat(path.c_str(), &pathStat)) == 0 &&
+           S_ISDIR(pathStat.st_mode);
+}
+
+/**
+ * Adds everything below prefix for a trailing **, which does not follow links into directories.
+ * A separator after it makes it match directories only.
+ */
+static void _addTree(const string &prefix, const vector<DirEntry> &entries, const string &separator,
+                     vector<string> &matches) {
+    for (const DirEntry &entry: entries) {
+        if (entry.name[0] == '.')
+            continue;
+        string path = prefix + entry.name;
+        bool isDirectory = _isDirectory(path, entry.type, false);
+        if (separator.empty())
+            matches.push_back(path);
+        else if (isDirectory || _isDirectory(path, entry.type, true))
+            matches.push_back(path + separator);
+        const vector<DirEntry> *children = isDirectory ? DirectoryCache::getInstance().list(path + "/") : nullptr;
+        if (children != nullptr)
+            _addTree(path + "/", *children, separator, matches);
+    }
+}
+
+/**
+ * Adds every path that matches the components from index on under prefix, which is empty for the
+ * current directory or ends with a separator.
+ */
+static void _walk(const vector<PathComponent> &components, size_t index, const string &prefix,
+                  vector<string> &matches) {
+    const PathComponent &component = components[index];
+    bool isLast = index + 1 == components.size();
+    bool dirsOnly = isLast && !component.separator.empty();
+    if (!_hasGlob(component.pattern)) {
+        string path = prefix + _unescape(component.pattern);
+        if (!isLast) {
+            _walk(components, index + 1, path + component.separator, matches);
+            return;
+        }
+        struct stat pathStat;
+        if (dirsOnly ? stat(path.c_str(), &pathStat) == 0 && S_ISDIR(pathStat.st_mode)
+                     : lstat(path.c_str(), &pathStat) == 0)
+            matches.push_back(path + component.separator);
+        return;
+    }
+    const vector<DirEntry> *entries = DirectoryCache::getInstance().list(prefix.empty() ? "." : prefix);
+    if (entries == nullptr)
+        return;
+    if (component.pattern == "**" && isLast) {
+        //the directory a trailing ** starts in is one of its matches
+        if (!prefix.empty())
+            matches.push_back(prefix);
+        _addTree(prefix, *entries, component.separator, matches);
+        return;
+    }
+    if (component.pattern == "**") {
+        _walk(components, index + 1, prefix, matches);
+        for (const DirEntry &entry: *entries) {
+            string path = prefix + entry.name;
+            if (entry.name[0] != '.' && _isDirectory(path, entry.type, false))
+                _walk(components, index, path + "/", matches);
+        }
+        return;
+    }
+    for (const DirEntry &entry: *entries) {
+        if (!_matchName(component.pattern.c_str(), entry.name.c_str()))
+            continue;
+        string path = prefix + entry.name;
+        if (isLast) {
+            if (!dirsOnly || _isDirectory(path, entry.type, true))
+                matches.push_back(path + component.separator);
+        } else if (_isDirectory(path, entry.type, true)) {
+            _walk(components, index + 1, path + component.separator, matches);
+        }
+    }
+}
+
+static void _glob(const string &pattern, vector<string> &matches) {
+    size_t start = pattern.find_first_not_of('/');
+    string root = pattern.substr(0, min(start, pattern.size()));
+    vector<PathComponent> components;
+    while (start < pattern.size()) {
+        size_t slash = min(pattern.find('/', start), pattern.size());
+        size_t next = min(pattern.find_first_not_of('/', slash), pattern.size());
+        PathComponent component = {pattern.substr(start, slash - start), pattern.substr(slash, next - slash)};
+        //a run of ** is a single one
+        if (component.pattern != "**" || components.empty() || components.back().pattern != "**")
+            components.push_back(component);
+        else
+            components.back().separator = component.separator;
+        start = next;
+    }
+    if (!components.empty())
+        _walk(components, 0, root, matches);
+}
+
+static bool _isNumber(const string &text) {
+    size_t digits = text[0] == '-' || text[0] == '+' ? 1 : 0;
+    return text.size() > digits && text.find_first_not_of("0123456789", digits) == string::npos;
+}
+
+//the width of a zero padded bound like 01, 0 when it is not padded
+static size_t _paddedWidth(const string &bound) {
+    size_t sign = bound[0] == '-' || bound[0] == '+' ? 1 : 0;
+    return bound.size() > sign + 1 && bound[sign] == '0' ? bound.size() : 0;
+}
+
+//the values of a sequence expression like 1..10, 01..10..2 or a..e, false when body is not one
+static bool _expandSequence(const string &body, vector<string> &values) {
+    size_t dots = body.find("..");
+    if (dots == string::npos || dots == 0)
+        return false;
+    string first = body.substr(0, dots), last = body.substr(dots + 2), increment = "1";
+    size_t stepDots = last.find("..");
+    if (stepDots != string::npos) {
+        increment = last.substr(stepDots + 2);
+        last = last.substr(0, stepDots);
+    }
+    if (last.empty() || increment.empty() || !_isNumber(increment))
+        return false;
+    long step = labs(atol(increment.c_str()));
+    if (step == 0)
+        step = 1;
+    if (_isNumber(first) && _isNumber(last)) {
+        long from = atol(first.c_str()), to = atol(last.c_str());
+        int width = max(_paddedWidth(first), _paddedWidth(last));
+        char value[32];
+        for (long i = from; from <= to ? i <= to : i >= to; i += from <= to ? step : -step) {
+            snprintf(value, sizeof(value), "%0*ld", width, i);
+            values.push_back(value);
+        }
+        return true;
+    }
+    if (first.size() == 1 && last.size() == 1 && isalpha(first[0]) && isalpha(last[0])) {
+        int from = first[0], to = last[0];
+        for (int c = from; from <= to ? c <= to : c >= to; c += from <= to ? step : -step)
+            values.push_back(string(1, (char) c));
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Brace expansion: the first {a,b} or {x..y} of word, left to right, is replaced by each of its
+ * alternatives and every resulting word expanded again. A brace with neither is literal.
+ */
+static void _expandBraces(const string &word, vector<string> &words) {
+    for (size_t open = 0; open < word.size(); open++) {
+        if (word[open] == '\\') {
+            open++;
+            continue;
+        }
+        if (word[open] != '{')
+            continue;
+        vector<size_t> commas;
+        size_t close = string::npos;
+        int depth = 0;
+        for (size_t i = open + 1; i < word.size() && close == string::npos; i++) {
+            if (word[i] == '\\')
+                i++;
+            else if (word[i] == '{')
+                depth++;
+            else if (word[i] == '}' && depth-- == 0)
+                close = i;
+            else if (word[i] == ',' && depth == 0)
+                commas.push_back(i);
+        }
+        if (close == string::npos)
+            continue;
+        vector<string> alternatives;
+        if (commas.empty()) {
+            if (!_expandSequence(word.substr(open + 1, close - open - 1), alternatives))
+                continue;
+        } else {
+            commas.push_back(close);
+            size_t start = open + 1;
+            for (size_t comma: commas) {
+                alternatives.push_back(word.substr(start, comma - start));
+                start = comma + 1;
+            }
+        }
+        string preamble = word.substr(0, open), postscript = word.substr(close + 1);
+        for (const string &alternative: alternatives)
+            _expandBraces(preamble + alternative + postscript, words);
+        return;
+    }
+    words.push_back(word);
+}
+
+void expandWord(const string &pattern, vector<string> &words) {
+    DirectoryCache &cache = DirectoryCache::getInstance();
+    if (cache.size() > GLOB_CACHE_MAX_DIRS)
+        cache.clear();
+    vector<string> braced;
+    _expandBraces(pattern, braced);
+    for (const string &word: braced) {
+        size_t first = words.size();
+        if (_hasGlob(word))
+            _glob(word, words);
+        if (words.size() == first) {
+            words.push_back(_unescape(word));
+            continue;
+        }
+        //bash sorts the matches of a word by the collation order of the locale
+        auto isBefore = [](const string &a, const string &b) {
+            return strcoll(a.c_str(), b.c_str()) < 0;
+        };
+        if (!is_sorted(words.begin() + first, words.end(), isBefore))
+            sort(words.begin() + first, words.end(), isBefore);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef SMASH_GLOBBING_H_
+#define SMASH_GLOBBING_H_
+
+#include <sys/types.h>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * In-process expansion of the words of a command line, the way bash expands them with globstar on:
+ * brace expansion first, then pathname expansion of every resulting word with *, ?, [...] and **.
+ * A word reaches expandWord as a pattern, in which a quoted or escaped character that would be
+ * special is escaped with a backslash.
+ */
+
+//the characters a quoted character is escaped from in a pattern
+#define GLOB_SPECIAL_CHARS "\\*?[]{},."
+//a script globbing over more directories than this starts over with an empty cache
+#define GLOB_CACHE_MAX_DIRS (1024)
+#define GLOB_DENTS_BUFFER_SIZE (1 << 16)
+
+//whether the unquoted part of a word may need expandWord, cheap enough for every line
+bool mayNeedExpansion(const char *text);
+
+/**
+ * Appends the words pattern expands to: every word of its brace expansion, replaced by the paths it
+ * matches sorted like bash sorts them, or kept with its escapes removed when it matches nothing.
+ */
+void expandWord(const std::string &pattern, std::vector<std::string> &words);
+
+struct DirEntry {
+    std::string name;
+    //the d_type of getdents64, DT_UNKNOWN on file systems that do not fill it
+    unsigned char type;
+};
+
+struct DirListing {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    //the directory was not modified during the clock tick it was read in, so its mtime proves it unchanged
+    bool isTrusted;
+    std::vector<DirEntry> entries;
+};
+
+/**
+ * The entries of the directories globs walk, read with getdents64, sorted, and kept until the mtime of
+ * their directory changes, so repeated globs over the same large directories cost a stat per directory.
+ * Inode times come from the coarse clock, a listing read during the tick its directory was modified
+ * in could miss a change that keeps the mtime, and is read again the next time.
+ */
+class DirectoryCache {
+    std::unordered_map<std::string, DirListing> listings;
+    char *buffer;
+
+    DirectoryCache() : buffer(nullptr) {}
+
+    bool read(const std::string &dir, DirListing &listing);
+
+public:
+    DirectoryCache(DirectoryCache const &) = delete;
+
+    void operator=(DirectoryCache const &) = delete;
+
+    static DirectoryCache &getInstance() {
+        static DirectoryCache instance;
+        return instance;
+    }
+
+    ~DirectoryCache() {
+        delete[] buffer;
+    }
+
+    //the entries of dir without . and .., nullptr when it can not be read
+    const std::vector<DirEntry> *list(const std::string &dir);
+
+    size_t size() const {
+        return listings.size();
+    }
+
+    void clear() {
+        listings.clear();
+    }
+};
+
+#endif //SMASH_GLOBBING_H_
@@ -0,0 +1,55 @@
+#include "smash_plugin.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * A sample plugin for smash: basename and dirname, the kind of small tool a script calls on every
+ * line. Build it with "make plugins" and load it with "enable -f ./libsmash_sample.so basename dirname".
+ */
+
+static int basename_run(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "smash error: basename: invalid arguments\n");
+        return 1;
+    }
+    char *path = argv[1];
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+    size_t start = length;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    if (start == length && length > 0)
+        start = length - 1;
+    size_t end = length;
+    if (argc == 3) {
+        size_t suffix = strlen(argv[2]);
+        if (suffix < end - start && strncmp(path + end - suffix, argv[2], suffix) == 0)
+            end -= suffix;
+    }
+    printf("%.*s\n", (int) (end - start), path + start);
+    return 0;
+}
+
+static int dirname_run(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "smash error: dirname: invalid arguments\n");
+        return 1;
+    }
+    char *path = argv[1];
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+    while (length > 0 && path[length - 1] != '/')
+        length--;
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+    if (length == 0)
+        printf(".\n");
+    else
+        printf("%.*s\n", (int) length, path);
+    return 0;
+}
+
+SMASH_BUILTIN(basename, basename_run);
+SMASH_BUILTIN(dirname, dirname_run);
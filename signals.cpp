@@ -1,18 +1,25 @@
 #include "signals.h"
+#include <sys/signalfd.h>
 
 using namespace std;
 
+/**
+* The handlers are called by handleSignals from the main loop of smash, never from a signal
+* context, so they can safely print and touch the jobs list.
+*/
+
 void ctrlZHandler(int sig_num) {
     cout << "smash: got ctrl-Z" << endl;
     SmallShell &smash = SmallShell::getInstance();
+    smash.countInterrupt();
     Command *fg = smash.getForegroundCommand();
-    if (fg == nullptr)
+    if (fg == nullptr || fg->getPid() == FAILURE)
         return;
     int jobIdToSet = smash.getForegroundJobId();
     if (jobIdToSet == -1)
         jobIdToSet = smash.getJobList()->getJobIdToSet();
     smash.getJobList()->addJob(fg, jobIdToSet, fg->getPid(), true);
-    if (kill(fg->getPid(), SIGSTOP) == FAILURE)
+    if (killpg(fg->getPid(), SIGSTOP) == FAILURE)
         SYS_CALL_ERROR_MESSAGE("stop");
     cout << "smash: process " << fg->getPid() << " was stopped" << endl;
     smash.resetForegroundJob();
@@ -21,18 +28,63 @@ void ctrlZHandler(int sig_num) {
 void ctrlCHandler(int sig_num) {
     cout << "smash: got ctrl-C" << endl;
     SmallShell &smash = SmallShell::getInstance();
+    smash.countInterrupt();
     Command *fg = smash.getForegroundCommand();
-    if (fg == nullptr)
+    if (fg == nullptr || fg->getPid() == FAILURE)
         return;
-    if (kill(fg->getPid(), SIGKILL) == FAILURE)
+    if (killpg(fg->getPid(), SIGKILL) == FAILURE)
         SYS_CALL_ERROR_MESSAGE("kill");
     cout << "smash: process " << fg->getPid() << " was killed" << endl;
+    int jobId = smash.getForegroundJobId();
     smash.resetForegroundJob();
+    //the group is no longer the foreground one once reaped, the jobs waiting on it learn it now
+    if (jobId != -1)
+        smash.onJobFinished(jobId, false);
 }
 
 void alarmHandler(int sig_num) {
     cout << "smash: got an alarm" << endl;
+    SmallShell::getInstance().onTimeoutsExpired();
+}
+
 
-//    cout<< "smash: "<<[command-line] <<" timed out!"<< endl;
+void childHandler(int sig_num) {
+    SmallShell::getInstance().reapChildren();
 }
 
+int setupSignalFd() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGALRM);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == FAILURE) {
+        perror("smash error: sigprocmask failed");
+        return FAILURE;
+    }
+    int fd = signalfd(FAILURE, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == FAILURE)
+        perror("smash error: signalfd failed");
+    return fd;
+}
+
+void handleSignals(int signalFd) {
+    struct signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGTSTP:
+                ctrlZHandler(info.ssi_signo);
+                break;
+            case SIGINT:
+                ctrlCHandler(info.ssi_signo);
+                break;
+            case SIGALRM:
+                alarmHandler(info.ssi_signo);
+                break;
+            case SIGCHLD:
+                childHandler(info.ssi_signo);
+                break;
+        }
+    }
+}
@@ -6,5 +6,11 @@
 void ctrlZHandler(int sig_num);
 void ctrlCHandler(int sig_num);
 void alarmHandler(int sig_num);
+void childHandler(int sig_num);
+
+//blocks the signals smash handles and returns a signalfd that delivers them instead
+int setupSignalFd();
+//dispatches every pending signal of signalFd to its handler, never blocks
+void handleSignals(int signalFd);
 
 #endif //SMASH__SIGNALS_H_
@@ -1,24 +1,30 @@
 #include "Commands.h"
 #include "signals.h"
+#include "zygote.h"
+#include <clocale>
 
 int main(int argc, char *argv[]) {
-    if (signal(SIGTSTP, ctrlZHandler) == SIG_ERR) {
-        perror("smash error: failed to set ctrl-Z handler");
+    //the zygote is forked before smash grows, launches stay cheap no matter how many fds and pages smash holds
+    Zygote::getInstance().start();
+    //globs sort their matches like bash does, in the collation order of the user's locale
+    setlocale(LC_COLLATE, "");
+    int inputFd = STDIN_FILENO;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        inputFd = open(argv[2], O_RDONLY | O_CLOEXEC);
+        if (inputFd == FAILURE) {
+            perror("smash error: open failed");
+            return 1;
+        }
+    } else if (argc != 1) {
+        std::cerr << "smash error: usage: smash [-f script]" << std::endl;
+        return 1;
     }
-    if (signal(SIGINT, ctrlCHandler) == SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
-    }
-    if (signal(SIGALRM, ctrlCHandler) == SIG_ERR) {
-        perror("smash error: failed to set sig_alarm handler");
-    }
-    //TODO: setup sig alarm handler
+    int signalFd = setupSignalFd();
+    if (signalFd == FAILURE)
+        return 1;
 
     SmallShell &smash = SmallShell::getInstance();
-    while (true) {
-        std::cout << smash.getPrompt() << "> ";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
-        smash.executeCommand(cmd_line.c_str());
-    }
-    return 0;
-}
\ No newline at end of file
+    smash.setSignalFd(signalFd);
+    //prompts are for a person at a terminal, a script or a pipe runs without them
+    return smash.run(inputFd, isatty(inputFd));
+}
@@ -0,0 +1,35 @@
+#ifndef SMASH_PLUGIN_H_
+#define SMASH_PLUGIN_H_
+
+/**
+ * The C ABI between smash and its loadable built-ins, see "enable -f".
+ * A plugin defines one SMASH_BUILTIN per command it provides. The command runs inside smash with
+ * smash's current stdin, stdout and stderr, so it must not exit, and must leave the signal mask,
+ * the signal handlers and the fds it did not open as it found them.
+ */
+
+#define SMASH_PLUGIN_ABI_VERSION (1)
+
+//smash looks the entry point of command name up as the symbol smash_builtin_<name>
+#define SMASH_BUILTIN_SYMBOL_PREFIX "smash_builtin_"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct smash_builtin {
+    //SMASH_PLUGIN_ABI_VERSION of the header the plugin was built with
+    int abi_version;
+    const char *name;
+    //argv is NULL terminated and argv[0] is the name, returns the exit status of the command
+    int (*run)(int argc, char **argv);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#define SMASH_BUILTIN(name, run) \
+    const struct smash_builtin smash_builtin_##name = {SMASH_PLUGIN_ABI_VERSION, #name, run}
+
+#endif //SMASH_PLUGIN_H_
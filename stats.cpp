@@ -0,0 +1,141 @@
+#include "stats.h"
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+bool statsEnabled = false;
+
+static const char *phaseNames[STATS_PHASES_COUNT] = {"line", "parse", "dispatch", "spawn", "wait", "reap"};
+static const char *kindNames[STATS_KINDS_COUNT] = {"builtin", "external", "pipe", "redirection", "plugin",
+                                                   "events"};
+
+void LatencyHistogram::add(long long ns) {
+    int bucket = ns <= 1 ? 0 : 63 - __builtin_clzll(ns);
+    buckets[bucket < STATS_BUCKETS_COUNT ? bucket : STATS_BUCKETS_COUNT - 1]++;
+    count++;
+    totalNs += ns;
+    if (ns > maxNs)
+        maxNs = ns;
+}
+
+long long LatencyHistogram::percentileNs(double percent) const {
+    unsigned long rank = (unsigned long) (percent / 100 * count + 0.5);
+    unsigned long seen = 0;
+    for (int i = 0; i < STATS_BUCKETS_COUNT; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) {
+            long long bound = 2LL << i;
+            return bound < maxNs ? bound : maxNs;
+        }
+    }
+    return maxNs;
+}
+
+void Stats::record(StatsPhase phase, long long startNs, long long endNs) {
+    TraceEvent event = {phase, startNs, endNs - startNs};
+    if (currentLine == nullptr) {
+        histograms[STATS_EVENTS][phase].add(event.durationNs);
+        if (trace != nullptr)
+            writeTraceEvent(STATS_EVENTS, event, nullptr);
+        return;
+    }
+    currentLine->phaseNs[phase] += event.durationNs;
+    currentLine->phasesSeen |= 1U << phase;
+    if (trace != nullptr && currentLine->eventsCount < STATS_LINE_EVENTS)
+        currentLine->events[currentLine->eventsCount++] = event;
+}
+
+void Stats::beginLine(LineStats *line, const char *cmd_line) {
+    line->cmd_line = cmd_line;
+    line->kind = STATS_BUILTIN;
+    for (long long &ns: line->phaseNs)
+        ns = 0;
+    line->phasesSeen = 0;
+    line->eventsCount = 0;
+    line->outer = currentLine;
+    currentLine = line;
+}
+
+void Stats::endLine(LineStats *line, long long startNs) {
+    currentLine = line;
+    record(STATS_LINE, startNs, nowNs());
+    currentLine = line->outer;
+    for (int phase = 0; phase < STATS_PHASES_COUNT; phase++) {
+        if (line->phasesSeen & (1U << phase))
+            histograms[line->kind][phase].add(line->phaseNs[phase]);
+    }
+    if (trace == nullptr)
+        return;
+    for (int i = 0; i < line->eventsCount; i++)
+        writeTraceEvent(line->kind, line->events[i], line->cmd_line);
+}
+
+//the line of a trace event names the command it was part of
+static void _writeJsonString(FILE *file, const char *text) {
+    fputc('"', file);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\')
+            fputc('\\', file);
+        if ((unsigned char) *text < 0x20)
+            fprintf(file, "\\u%04x", *text);
+        else
+            fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+void Stats::writeTraceEvent(StatsKind kind, const TraceEvent &event, const char *cmd_line) {
+    //complete events of the Chrome trace format, timestamps and durations are in us
+    fprintf(trace, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+            traceSeparator, phaseNames[event.phase], kindNames[kind], event.startNs / 1e3, event.durationNs / 1e3,
+            getpid(), getpid());
+    if (cmd_line != nullptr && event.phase == STATS_LINE) {
+        fputs(",\"args\":{\"cmd_line\":", trace);
+        _writeJsonString(trace, cmd_line);
+        fputc('}', trace);
+    }
+    fputs("}", trace);
+    traceSeparator = ",\n";
+}
+
+void Stats::print() {
+    printf("%-12s %-9s %10s %12s %12s %12s %12s\n", "kind", "phase", "count", "mean_us", "p50_us", "p99_us",
+           "max_us");
+    for (int kind = 0; kind < STATS_KINDS_COUNT; kind++) {
+        for (int phase = 0; phase < STATS_PHASES_COUNT; phase++) {
+            const LatencyHistogram &histogram = histograms[kind][phase];
+            if (histogram.count == 0)
+                continue;
+            printf("%-12s %-9s %10lu %12.1f %12.1f %12.1f %12.1f\n", kindNames[kind], phaseNames[phase],
+                   histogram.count, (double) histogram.totalNs / histogram.count / 1e3,
+                   histogram.percentileNs(50) / 1e3, histogram.percentileNs(99) / 1e3, histogram.maxNs / 1e3);
+        }
+    }
+    fflush(stdout);
+}
+
+void Stats::reset() {
+    for (auto &kindHistograms: histograms) {
+        for (LatencyHistogram &histogram: kindHistograms)
+            histogram = LatencyHistogram();
+    }
+}
+
+bool Stats::startTrace(const string &path) {
+    stopTrace();
+    trace = fopen(path.c_str(), "we");
+    if (trace == nullptr)
+        return false;
+    fputs("[\n", trace);
+    traceSeparator = "";
+    return true;
+}
+
+void Stats::stopTrace() {
+    if (trace == nullptr)
+        return;
+    fputs("\n]\n", trace);
+    fclose(trace);
+    trace = nullptr;
+}
@@ -0,0 +1,159 @@
+#ifndef SMASH_STATS_H_
+#define SMASH_STATS_H_
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+/**
+ * Latency instrumentation of smash's own hot path. Every phase of a command line is timed with
+ * CLOCK_MONOTONIC and added to a fixed log2 histogram of its command kind, and optionally written
+ * to a Chrome trace file. While disabled, every probe costs a single branch on statsEnabled.
+ */
+
+enum StatsPhase {
+    //the whole executeCommand of a line, every other phase is part of it
+    STATS_LINE,
+    //splitting the line into arguments, part of dispatch
+    STATS_PARSE,
+    STATS_DISPATCH,
+    STATS_SPAWN,
+    //waiting for the foreground processes, reaping them included
+    STATS_WAIT,
+    STATS_REAP,
+    STATS_PHASES_COUNT
+};
+
+enum StatsKind {
+    STATS_BUILTIN,
+    STATS_EXTERNAL,
+    STATS_PIPE,
+    STATS_REDIRECTION,
+    STATS_PLUGIN,
+    //work done between lines, like reaping background jobs
+    STATS_EVENTS,
+    STATS_KINDS_COUNT
+};
+
+//bucket i counts durations of [2^i, 2^(i+1)) ns, the last one everything longer
+#define STATS_BUCKETS_COUNT (40)
+//trace events kept per line, the deeper ones of a huge pipeline are dropped
+#define STATS_LINE_EVENTS (32)
+
+extern bool statsEnabled;
+
+struct LatencyHistogram {
+    unsigned long count;
+    long long totalNs;
+    long long maxNs;
+    unsigned long buckets[STATS_BUCKETS_COUNT];
+
+    void add(long long ns);
+
+    //the upper bound of the bucket holding the percentile, never above the max
+    long long percentileNs(double percent) const;
+};
+
+struct TraceEvent {
+    StatsPhase phase;
+    long long startNs;
+    long long durationNs;
+};
+
+//the phases of the line being executed, committed to the histograms once its kind is known
+struct LineStats {
+    const char *cmd_line;
+    StatsKind kind;
+    long long phaseNs[STATS_PHASES_COUNT];
+    unsigned phasesSeen;
+    int eventsCount;
+    TraceEvent events[STATS_LINE_EVENTS];
+    //the line that runs this one, like the line of a time or bench built-in
+    LineStats *outer;
+};
+
+class Stats {
+    LatencyHistogram histograms[STATS_KINDS_COUNT][STATS_PHASES_COUNT];
+    LineStats *currentLine;
+    FILE *trace;
+    const char *traceSeparator;
+
+    Stats() : histograms(), currentLine(nullptr), trace(nullptr), traceSeparator("") {}
+
+    void writeTraceEvent(StatsKind kind, const TraceEvent &event, const char *cmd_line);
+
+public:
+    Stats(Stats const &) = delete;
+
+    void operator=(Stats const &) = delete;
+
+    static Stats &getInstance() {
+        static Stats instance;
+        return instance;
+    }
+
+    ~Stats() {
+        stopTrace();
+    }
+
+    static long long nowNs() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
+
+    void record(StatsPhase phase, long long startNs, long long endNs);
+
+    void beginLine(LineStats *line, const char *cmd_line);
+
+    void setLineKind(StatsKind kind) {
+        if (currentLine != nullptr)
+            currentLine->kind = kind;
+    }
+
+    void endLine(LineStats *line, long long startNs);
+
+    void print();
+
+    void reset();
+
+    //starts writing every phase to path as Chrome trace events, false when it can not be created
+    bool startTrace(const std::string &path);
+
+    void stopTrace();
+};
+
+//times the scope it lives in as phase
+class StatsScope {
+    StatsPhase phase;
+    long long startNs;
+public:
+    explicit StatsScope(StatsPhase phase) : phase(phase), startNs(statsEnabled ? Stats::nowNs() : 0) {}
+
+    ~StatsScope() {
+        if (startNs != 0)
+            Stats::getInstance().record(phase, startNs, Stats::nowNs());
+    }
+};
+
+//the scope of a whole command line
+class StatsLineScope {
+    LineStats line;
+    long long startNs;
+public:
+    explicit StatsLineScope(const char *cmd_line) : startNs(statsEnabled ? Stats::nowNs() : 0) {
+        if (startNs != 0)
+            Stats::getInstance().beginLine(&line, cmd_line);
+    }
+
+    ~StatsLineScope() {
+        if (startNs != 0)
+            Stats::getInstance().endLine(&line, startNs);
+    }
+
+    bool isActive() const {
+        return startNs != 0;
+    }
+};
+
+#endif //SMASH_STATS_H_
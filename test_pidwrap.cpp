@@ -0,0 +1,100 @@
+#include "Commands.h"
+#include "signals.h"
+#include <sched.h>
+
+using namespace std;
+
+/**
+ * Forces pid wraparound inside a new PID namespace. A background job of smash is killed and reaped
+ * behind the back of the jobs list, then an unrelated process is created with the very same pid
+ * and made a process group leader. "kill -9" on the stale job must not reach that process.
+ * Prints SKIPPED when PID namespaces can not be created (e.g. not running as root).
+ */
+
+static void writeLine(int fd, pid_t value) {
+    if (write(fd, &value, sizeof(value)) != sizeof(value))
+        perror("write");
+}
+
+static pid_t readLine(int fd) {
+    pid_t value = FAILURE;
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return FAILURE;
+    return value;
+}
+
+//runs as pid 2 of the namespace, in the role of smash
+static int runSmash(int toInit, int fromInit) {
+    SmallShell &smash = SmallShell::getInstance();
+    smash.setSignalFd(setupSignalFd());
+    smash.executeCommand("sleep 100&");
+    JobsList::JobEntry *job = smash.getJobList()->getJobById(1);
+    if (job == nullptr) {
+        cout << "pid wraparound test: FAILED (the job was not created)" << endl;
+        return 1;
+    }
+    pid_t pid = job->getProcessId();
+    if (job->getPidfd() == FAILURE)
+        cout << "pid wraparound test: no pidfd support, testing the fallback path" << endl;
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    writeLine(toInit, pid);
+    if (readLine(fromInit) != pid) {
+        cout << "pid wraparound test: FAILED (could not recycle pid " << pid << ")" << endl;
+        return 1;
+    }
+    smash.executeCommand("kill -9 1");
+    cout.flush();
+    writeLine(toInit, 0);
+    return 0;
+}
+
+//runs as pid 1 of the namespace, it creates the process that recycles the pid of the job
+static int runInit() {
+    int toInit[2], fromInit[2];
+    if (pipe(toInit) == FAILURE || pipe(fromInit) == FAILURE)
+        return 1;
+    pid_t smashPid = fork();
+    if (smashPid == 0)
+        _exit(runSmash(toInit[1], fromInit[0]));
+    pid_t pid = readLine(toInit[0]);
+    if (pid == FAILURE)
+        return 1;
+    ofstream lastPid("/proc/sys/kernel/ns_last_pid");
+    lastPid << pid - 1 << endl;
+    lastPid.close();
+    pid_t victim = fork();
+    if (victim == 0) {
+        setpgid(0, 0);
+        pause();
+        _exit(0);
+    }
+    writeLine(fromInit[1], victim);
+    readLine(toInit[0]);
+    int status;
+    waitpid(smashPid, &status, 0);
+    if (victim != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 1;
+    bool isAlive = waitpid(victim, nullptr, WNOHANG) == 0;
+    kill(victim, SIGKILL);
+    waitpid(victim, nullptr, 0);
+    cout << "pid wraparound test: " << (isAlive ? "PASSED" : "FAILED (the recycled pid was killed)") << endl;
+    return isAlive ? 0 : 1;
+}
+
+int main() {
+    if (unshare(CLONE_NEWPID) == FAILURE) {
+        cout << "pid wraparound test: SKIPPED (" << strerror(errno) << ")" << endl;
+        return 0;
+    }
+    pid_t init = fork();
+    if (init == FAILURE) {
+        perror("fork");
+        return 1;
+    }
+    if (init == 0)
+        _exit(runInit());
+    int status;
+    waitpid(init, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,228 @@
+#include "transfer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <vector>
+
+#define FAILURE -1
+
+enum TransferMethod {
+    TRANSFER_SPLICE,
+    TRANSFER_COPY_FILE_RANGE,
+    TRANSFER_SENDFILE,
+    TRANSFER_BUFFERED
+};
+
+//a single system call never moves more, so a huge count does not overflow ssize_t
+#define TRANSFER_MAX_CHUNK ((size_t) 1 << 30)
+
+ssize_t writeAll(int fd, const void *buffer, size_t size) {
+    const char *data = (const char *) buffer;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t ret = write(fd, data + written, size - written);
+        if (ret == FAILURE) {
+            if (errno == EINTR)
+                continue;
+            return FAILURE;
+        }
+        written += ret;
+    }
+    return written;
+}
+
+static TransferMethod _pickMethod(int inFd, int outFd) {
+    struct stat in, out;
+    if (fstat(inFd, &in) == FAILURE || fstat(outFd, &out) == FAILURE)
+        return TRANSFER_BUFFERED;
+    //the kernel refuses to splice or copy_file_range into a file opened for appending
+    int outFlags = fcntl(outFd, F_GETFL);
+    bool appends = outFlags != FAILURE && (outFlags & O_APPEND);
+    if (S_ISFIFO(out.st_mode) || (S_ISFIFO(in.st_mode) && !appends))
+        return TRANSFER_SPLICE;
+    if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode) && !appends)
+        return TRANSFER_COPY_FILE_RANGE;
+    if (S_ISREG(in.st_mode))
+        return TRANSFER_SENDFILE;
+    return TRANSFER_BUFFERED;
+}
+
+static ssize_t _bufferedChunk(int inFd, off_t *offset, int outFd, size_t count) {
+    static char *block = nullptr;
+    if (block == nullptr && posix_memalign((void **) &block, sysconf(_SC_PAGESIZE), TRANSFER_BLOCK_SIZE) != 0) {
+        block = nullptr;
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    count = std::min(count, (size_t) TRANSFER_BLOCK_SIZE);
+    ssize_t bytes = offset != nullptr ? pread(inFd, block, count, *offset) : read(inFd, block, count);
+    if (bytes <= 0)
+        return bytes;
+    if (writeAll(outFd, block, bytes) == FAILURE)
+        return FAILURE;
+    if (offset != nullptr)
+        *offset += bytes;
+    return bytes;
+}
+
+ssize_t transferBytes(int inFd, off_t *offset, int outFd, size_t count) {
+    TransferMethod method = _pickMethod(inFd, outFd);
+    size_t moved = 0;
+    while (moved < count) {
+        size_t chunk = std::min(count - moved, TRANSFER_MAX_CHUNK);
+        ssize_t ret;
+        switch (method) {
+            case TRANSFER_SPLICE:
+                ret = splice(inFd, offset, outFd, nullptr, chunk, SPLICE_F_MOVE);
+                break;
+            case TRANSFER_COPY_FILE_RANGE:
+                ret = copy_file_range(inFd, offset, outFd, nullptr, chunk, 0);
+                break;
+            case TRANSFER_SENDFILE:
+                ret = sendfile(outFd, inFd, offset, chunk);
+                break;
+            default:
+                ret = _bufferedChunk(inFd, offset, outFd, chunk);
+        }
+        if (ret == FAILURE) {
+            if (errno == EINTR)
+                continue;
+            //this pair of files is not supported by the method, and nothing was moved with it yet
+            bool refused = errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP ||
+                           errno == EBADF;
+            if (moved == 0 && refused && method != TRANSFER_BUFFERED) {
+                method = method == TRANSFER_COPY_FILE_RANGE ? TRANSFER_SENDFILE : TRANSFER_BUFFERED;
+                continue;
+            }
+            return FAILURE;
+        }
+        if (ret == 0)
+            break;
+        moved += ret;
+    }
+    return moved;
+}
+
+//takes count bytes out of the pipe inFd
+static int _discard(int inFd, int devNull, size_t count) {
+    while (count > 0) {
+        ssize_t ret = splice(inFd, nullptr, devNull, nullptr, count, 0);
+        if (ret == FAILURE && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FAILURE;
+        count -= ret;
+    }
+    return 0;
+}
+
+/**
+ * Gives outFd as much as it takes of the bytes of the pipe inFd from offset to end, and leaves them
+ * in inFd. tee always starts at the head of a pipe, so the part before offset is skipped through the
+ * empty scratch pipe, which is as large as inFd so the head always fits in it.
+ */
+static ssize_t _teeFrom(int inFd, int outFd, size_t offset, size_t end, const int scratch[2], int devNull) {
+    if (offset == 0)
+        return tee(inFd, outFd, end, SPLICE_F_NONBLOCK);
+    ssize_t copied = tee(inFd, scratch[1], end, SPLICE_F_NONBLOCK);
+    if (copied == FAILURE)
+        return FAILURE;
+    ssize_t ret = 0;
+    if ((size_t) copied > offset && _discard(scratch[0], devNull, offset) == 0)
+        ret = splice(scratch[0], nullptr, outFd, nullptr, copied - offset, SPLICE_F_NONBLOCK);
+    int savedErrno = errno;
+    int left = 0;
+    if (ioctl(scratch[0], FIONREAD, &left) == 0 && left > 0)
+        _discard(scratch[0], devNull, left);
+    errno = savedErrno;
+    return ret;
+}
+
+int fanOutPipe(int inFd, const int *outFds, int count) {
+    //sent[i] is how much of what inFd holds right now reader i already got, FAILURE once it is gone
+    std::vector<ssize_t> sent(count, 0);
+    int aliveCount = count;
+    int scratch[2] = {FAILURE, FAILURE};
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int ret = FAILURE;
+    if (devNull == FAILURE || pipe2(scratch, O_CLOEXEC) == FAILURE ||
+        fcntl(scratch[1], F_SETPIPE_SZ, fcntl(inFd, F_GETPIPE_SZ)) == FAILURE)
+        aliveCount = 0;
+    else
+        ret = 0;
+    while (aliveCount > 0) {
+        int available = 0;
+        if (ioctl(inFd, FIONREAD, &available) == FAILURE) {
+            ret = FAILURE;
+            break;
+        }
+        if (available == 0) {
+            struct pollfd pfd = {inFd, POLLIN, 0};
+            if (poll(&pfd, 1, -1) == FAILURE && errno != EINTR) {
+                ret = FAILURE;
+                break;
+            }
+            //the writer is gone and everything it wrote was handed out
+            if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLIN))
+                break;
+            continue;
+        }
+        ssize_t least = available;
+        for (int i = 0; i < count; i++) {
+            if (sent[i] == FAILURE || sent[i] == available)
+                continue;
+            ssize_t given = _teeFrom(inFd, outFds[i], sent[i], available, scratch, devNull);
+            if (given == FAILURE && errno == EPIPE) {
+                sent[i] = FAILURE;
+                aliveCount--;
+                continue;
+            }
+            if (given == FAILURE && errno != EAGAIN && errno != EINTR) {
+                aliveCount = 0;
+                ret = FAILURE;
+                break;
+            }
+            if (given > 0)
+                sent[i] += given;
+            least = std::min(least, sent[i]);
+        }
+        if (aliveCount == 0)
+            break;
+        if (least > 0) {
+            if (_discard(inFd, devNull, least) == FAILURE) {
+                ret = FAILURE;
+                break;
+            }
+            for (ssize_t &bytes: sent) {
+                if (bytes != FAILURE)
+                    bytes -= least;
+            }
+            continue;
+        }
+        //the slowest readers took nothing yet, wait until one of them has room
+        std::vector<struct pollfd> lagging;
+        for (int i = 0; i < count; i++) {
+            if (sent[i] == 0)
+                lagging.push_back({outFds[i], POLLOUT, 0});
+        }
+        if (poll(lagging.data(), lagging.size(), -1) == FAILURE && errno != EINTR) {
+            ret = FAILURE;
+            break;
+        }
+    }
+    int savedErrno = errno;
+    if (devNull != FAILURE)
+        close(devNull);
+    if (scratch[0] != FAILURE) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    errno = savedErrno;
+    return ret;
+}
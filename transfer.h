@@ -0,0 +1,37 @@
+#ifndef SMASH_TRANSFER_H_
+#define SMASH_TRANSFER_H_
+
+#include <sys/types.h>
+#include <cstddef>
+
+//what a single system call of the buffered fallback moves at most
+#define TRANSFER_BLOCK_SIZE (1 << 20)
+
+/**
+ * Moves count bytes from inFd to outFd, without passing them through smash whenever the kernel can:
+ * splice when either end is a pipe, copy_file_range between regular files, and sendfile from a
+ * regular file to anything else. A pair of fds the kernel refuses falls back to read and write
+ * through a page aligned buffer of TRANSFER_BLOCK_SIZE.
+ * inFd is read from *offset, which is advanced, or from its file position when offset is null.
+ * Returns the number of bytes moved, fewer than count once inFd is exhausted, or FAILURE with errno.
+ */
+ssize_t transferBytes(int inFd, off_t *offset, int outFd, size_t count);
+
+/**
+ * Copies everything written to the pipe inFd into every pipe of outFds, until inFd reaches EOF or no
+ * reader is left. tee(2) duplicates the bytes inside the kernel, and they leave inFd only once every
+ * reader took them: a slow reader holds the writer back instead of piling data up, so at most a pipe
+ * worth of data waits for it. A reader that went away is dropped, the others go on.
+ * Returns 0, or FAILURE with errno on an unexpected error.
+ */
+int fanOutPipe(int inFd, const int *outFds, int count);
+
+//the distributor of a fan-out runs fanOutPipe in a process of its own, installed next to smash
+#define FANOUT_HELPER_NAME "smash_fanout"
+//the helper reads its stdin and writes to fds FANOUT_FIRST_FD and up, one per consumer
+#define FANOUT_FIRST_FD (3)
+
+//writes all size bytes, retrying short writes, returns FAILURE with errno on error
+ssize_t writeAll(int fd, const void *buffer, size_t size);
+
+#endif //SMASH_TRANSFER_H_
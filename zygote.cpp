@@ -0,0 +1,251 @@
+#include "zygote.h"
+#include <sys/socket.h>
+#include <sched.h>
+
+using namespace std;
+
+//the cwd, stdin, stdout and stderr of the new process, in this order, then its extra fds
+#define ZYGOTE_STDIO_FDS_COUNT (4)
+#define ZYGOTE_MAX_FDS (ZYGOTE_STDIO_FDS_COUNT + ZYGOTE_MAX_EXTRA_FDS)
+
+struct ZygoteRequest {
+    pid_t pgid;
+    int argc;
+    int envc;
+    int fdsCount;
+    //the path, the arguments and the environment, each NULL terminated, follow the request
+    size_t payloadSize;
+};
+
+struct ZygoteReply {
+    pid_t pid;
+    int error;
+};
+
+static bool _writeAll(int fd, const void *data, size_t size) {
+    const char *c = (const char *) data;
+    while (size > 0) {
+        ssize_t bytes = send(fd, c, size, MSG_NOSIGNAL);
+        if (bytes == FAILURE && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return false;
+        c += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool _readAll(int fd, void *data, size_t size) {
+    char *c = (char *) data;
+    while (size > 0) {
+        ssize_t bytes = read(fd, c, size);
+        if (bytes == FAILURE && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return false;
+        c += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool _sendRequest(int sock, const ZygoteRequest &request, const int fds[]) {
+    char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))] = {};
+    struct iovec iov = {(void *) &request, sizeof(request)};
+    struct msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(request.fdsCount * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(request.fdsCount * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, request.fdsCount * sizeof(int));
+    ssize_t bytes;
+    while ((bytes = sendmsg(sock, &message, MSG_NOSIGNAL)) == FAILURE && errno == EINTR);
+    //the fds travel with the first byte, the rest of the request is plain data
+    return bytes > 0 && _writeAll(sock, (const char *) &request + bytes, sizeof(request) - bytes);
+}
+
+static bool _receiveRequest(int sock, ZygoteRequest &request, int fds[ZYGOTE_MAX_FDS]) {
+    char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))] = {};
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t bytes = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (bytes <= 0 || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || (message.msg_flags & MSG_CTRUNC))
+        return false;
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    if (!_readAll(sock, (char *) &request + bytes, sizeof(request) - bytes) || request.fdsCount != count) {
+        for (int i = 0; i < count; i++)
+            close(fds[i]);
+        return false;
+    }
+    return count >= ZYGOTE_STDIO_FDS_COUNT;
+}
+
+struct ZygoteLaunch {
+    const char *path;
+    char **argv;
+    char **envp;
+    pid_t pgid;
+    const int *fds;
+    int fdsCount;
+    //written by the new process when it fails before or at exec
+    int error;
+};
+
+//runs in the new process, on its own stack and in the memory of the zygote until it execs
+static int _execChild(void *arg) {
+    ZygoteLaunch *launch = (ZygoteLaunch *) arg;
+    if (setpgid(0, launch->pgid) == FAILURE || fchdir(launch->fds[0]) == FAILURE) {
+        launch->error = errno;
+        _exit(127);
+    }
+    //every fd goes above the targets first, so a dup2 never replaces one that is still to be used
+    int targetsCount = launch->fdsCount - 1;
+    int moved[ZYGOTE_MAX_FDS];
+    for (int i = 0; i < targetsCount; i++) {
+        moved[i] = fcntl(launch->fds[i + 1], F_DUPFD_CLOEXEC, targetsCount);
+        if (moved[i] == FAILURE) {
+            launch->error = errno;
+            _exit(127);
+        }
+    }
+    for (int i = 0; i < targetsCount; i++) {
+        if (dup2(moved[i], i) == FAILURE) {
+            launch->error = errno;
+            _exit(127);
+        }
+    }
+    sigset_t emptyMask;
+    sigemptyset(&emptyMask);
+    sigprocmask(SIG_SETMASK, &emptyMask, nullptr);
+    execve(launch->path, launch->argv, launch->envp);
+    launch->error = errno;
+    _exit(127);
+}
+
+static ZygoteReply _launch(char *path, char **argv, char **envp, pid_t pgid, const int fds[], int fdsCount) {
+    static char childStack[1 << 16];
+    ZygoteLaunch launch = {path, argv, envp, pgid, fds, fdsCount, 0};
+    /**
+     * Like posix_spawn: the zygote is suspended until the new process execs or exits, so the memory
+     * is shared instead of copied. CLONE_PARENT makes it a child of smash instead of the zygote.
+     */
+    pid_t child = clone(_execChild, childStack + sizeof(childStack), CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD,
+                        &launch);
+    ZygoteReply reply = {child, 0};
+    if (child == FAILURE)
+        reply.error = errno;
+    else if (launch.error != 0)
+        reply = {FAILURE, launch.error};
+    return reply;
+}
+
+//the main loop of the zygote, serves requests until smash closes its end of the socket
+static void _serve(int sock) {
+    //signals sent to smash's process group, like ctrl-C, are not for the zygote
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    sigprocmask(SIG_BLOCK, &allSignals, nullptr);
+    vector<char> payload;
+    vector<char *> argv, envp;
+    while (true) {
+        ZygoteRequest request;
+        int fds[ZYGOTE_MAX_FDS];
+        if (!_receiveRequest(sock, request, fds))
+            _exit(0);
+        payload.resize(request.payloadSize + 1);
+        if (!_readAll(sock, payload.data(), request.payloadSize))
+            _exit(0);
+        payload[request.payloadSize] = '\0';
+        char *c = payload.data();
+        char *path = c;
+        c += strlen(c) + 1;
+        argv.clear();
+        envp.clear();
+        for (int i = 0; i < request.argc; i++, c += strlen(c) + 1)
+            argv.push_back(c);
+        for (int i = 0; i < request.envc; i++, c += strlen(c) + 1)
+            envp.push_back(c);
+        argv.push_back(nullptr);
+        envp.push_back(nullptr);
+        ZygoteReply reply = _launch(path, argv.data(), envp.data(), request.pgid, fds, request.fdsCount);
+        for (int i = 0; i < request.fdsCount; i++)
+            close(fds[i]);
+        if (!_writeAll(sock, &reply, sizeof(reply)))
+            _exit(0);
+    }
+}
+
+bool Zygote::start() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == FAILURE) {
+        perror("smash error: socketpair failed");
+        return false;
+    }
+    pid = fork();
+    if (pid == FAILURE) {
+        perror("smash error: fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        _serve(fds[1]);
+    }
+    close(fds[1]);
+    sock = fds[0];
+    return true;
+}
+
+void Zygote::stop() {
+    if (sock == FAILURE)
+        return;
+    close(sock);
+    sock = FAILURE;
+    pid = FAILURE;
+}
+
+pid_t Zygote::spawn(const char *path, char *const argv[], pid_t pgid, int inFd, int outFd, int errFd,
+                    const vector<int> &extraFds) {
+    if (extraFds.size() > ZYGOTE_MAX_EXTRA_FDS) {
+        errno = E2BIG;
+        return FAILURE;
+    }
+    ZygoteRequest request = {pgid, 0, 0, (int) (ZYGOTE_STDIO_FDS_COUNT + extraFds.size()), 0};
+    string payload(path, strlen(path) + 1);
+    for (; argv[request.argc] != nullptr; request.argc++)
+        payload.append(argv[request.argc], strlen(argv[request.argc]) + 1);
+    for (; environ[request.envc] != nullptr; request.envc++)
+        payload.append(environ[request.envc], strlen(environ[request.envc]) + 1);
+    request.payloadSize = payload.size();
+    int cwdFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwdFd == FAILURE)
+        return FAILURE;
+    int fds[ZYGOTE_MAX_FDS] = {cwdFd, inFd == FAILURE ? STDIN_FILENO : inFd,
+                               outFd == FAILURE ? STDOUT_FILENO : outFd, errFd == FAILURE ? STDERR_FILENO : errFd};
+    copy(extraFds.begin(), extraFds.end(), fds + ZYGOTE_STDIO_FDS_COUNT);
+    ZygoteReply reply;
+    bool isAnswered = _sendRequest(sock, request, fds) && _writeAll(sock, payload.data(), payload.size()) &&
+                      _readAll(sock, &reply, sizeof(reply));
+    close(cwdFd);
+    if (!isAnswered) {
+        //the zygote is gone, smash launches by itself from now on
+        stop();
+        errno = ECHILD;
+        return FAILURE;
+    }
+    if (reply.pid == FAILURE)
+        errno = reply.error;
+    return reply.pid;
+}
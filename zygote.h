@@ -0,0 +1,64 @@
+#ifndef SMASH_ZYGOTE_H_
+#define SMASH_ZYGOTE_H_
+
+#include "Commands.h"
+
+/**
+ * A helper process forked while smash is still small, that launches external commands on its behalf.
+ * Every request carries the path, argv and environment, the pgid to join and, through SCM_RIGHTS,
+ * the cwd and stdio fds of the new process. The zygote creates the process with CLONE_PARENT, so it
+ * is a child of smash like any other: smash reaps it, opens its pidfd and controls its process
+ * group exactly as when it launches it itself. Only the zygote's own small memory map and fd table
+ * are copied, however large smash grows.
+ */
+//the kernel passes at most 253 fds in a single message (SCM_MAX_FD), the cwd and stdio take 4 of them
+#define ZYGOTE_MAX_EXTRA_FDS (249)
+
+class Zygote {
+    //smash's end of the socket, FAILURE when the zygote is not running
+    int sock;
+    pid_t pid;
+    bool isEnabled;
+
+    Zygote() : sock(FAILURE), pid(FAILURE), isEnabled(true) {}
+
+public:
+    Zygote(Zygote const &) = delete;
+
+    void operator=(Zygote const &) = delete;
+
+    static Zygote &getInstance() {
+        static Zygote instance;
+        return instance;
+    }
+
+    ~Zygote() {
+        stop();
+    }
+
+    //forks the zygote, call it as early as possible
+    bool start();
+
+    //the zygote exits once its socket is closed, and smash reaps it like any child it does not track
+    void stop();
+
+    bool isRunning() {
+        return sock != FAILURE && isEnabled;
+    }
+
+    //launches are done by smash itself while disabled, the zygote keeps running
+    void setEnabled(bool enabled) {
+        isEnabled = enabled;
+    }
+
+    /**
+     * Launches path into process group pgid (0 for a new group) in the cwd and environment of smash.
+     * inFd, outFd and errFd become the stdio of the new process, FAILURE keeps smash's own, and
+     * extraFds[i] becomes its fd 3 + i.
+     * Returns FAILURE with errno set when exec fails, and stops the zygote when it does not answer.
+     */
+    pid_t spawn(const char *path, char *const argv[], pid_t pgid, int inFd, int outFd, int errFd,
+                const vector<int> &extraFds = vector<int>());
+};
+
+#endif //SMASH_ZYGOTE_H_